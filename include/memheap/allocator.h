@@ -8,10 +8,34 @@
 namespace memheap
 {
 	extern heap* g_std_heap;
+	extern unsigned long g_std_heap_generation; //new with every init_std_allocator()
 
-	void init_std_allocator(bool thread_safe, msize est_max_size, msize est_cnt);
+	void init_std_allocator(bool thread_safe, msize est_max_size, msize est_cnt, const heap_options& opt = heap_options());
 	void free_std_allocator();
 
+	//base for the classes whose objects live in g_std_heap,
+	//the sized delete hands the size back to heap::free(p, n)
+	struct std_heap_object
+	{
+		static void* operator new(std::size_t n) { return g_std_heap->allocate(n); }
+		static void* operator new[](std::size_t n) { return g_std_heap->allocate(n); }
+		static void operator delete(void* p, std::size_t n) { g_std_heap->free(p, n); }
+		static void operator delete[](void* p, std::size_t n) { g_std_heap->free(p, n); }
+	};
+
+	//what allocate_at_least() returns, std::allocation_result where the library has it (C++23)
+#if defined(__cpp_lib_allocate_at_least)
+	template <typename P>
+	using allocation_result = std::allocation_result<P>;
+#else
+	template <typename P>
+	struct allocation_result
+	{
+		P ptr;
+		size_t count;
+	};
+#endif
+
     template <typename T, int N=sizeof(T)>
 	struct allocator
 	{
@@ -28,6 +52,9 @@ namespace memheap
 
 		pointer allocate(size_type n, const void * = 0)
 		{
+			if (alignof(T) <= alignof(msize)) //the heap alignment does
+				return static_cast<pointer>(g_std_heap->allocate(n*sizeof(T)));
+
 			int offset = alignof(T) - 1 + sizeof(void*);
 			void* p1 = g_std_heap->allocate(n*sizeof(T) + offset);
 			void** p2 = (void**)(((size_t)(p1) + offset) & ~(alignof(T) - 1));
@@ -35,8 +62,26 @@ namespace memheap
 			return (pointer)p2;
 		}
 
-		void deallocate(void* p, size_type) {
-			g_std_heap->free(((void**)p)[-1]);
+		//count of T that fit into the block past the alignment
+		allocation_result<pointer> allocate_at_least(size_type n)
+		{
+			if (alignof(T) <= alignof(msize)) {
+				heap::allocation_result r = g_std_heap->allocate_at_least(n*sizeof(T));
+				return {static_cast<pointer>(r.ptr_), r.size_ / sizeof(T)};
+			}
+
+			int offset = alignof(T) - 1 + sizeof(void*);
+			heap::allocation_result r = g_std_heap->allocate_at_least(n*sizeof(T) + offset);
+			void** p2 = (void**)(((size_t)(r.ptr_) + offset) & ~(alignof(T) - 1));
+			*(p2-1) = r.ptr_;
+			return {(pointer)p2, ((size_t)(r.ptr_) + r.size_ - (size_t)p2) / sizeof(T)};
+		}
+
+		void deallocate(void* p, size_type n) {
+			if (alignof(T) <= alignof(msize))
+				g_std_heap->free(p, n*sizeof(T));
+			else
+				g_std_heap->free(((void**)p)[-1]);
 		}
 
 		pointer address(reference x) const { return &x; }
@@ -86,8 +131,13 @@ namespace memheap
 		{
 			return static_cast<pointer>(g_std_heap->allocate(n));
 		}
-		void deallocate(void* p, size_type) {
-			g_std_heap->free(p);
+		allocation_result<pointer> allocate_at_least(size_type n)
+		{
+			heap::allocation_result r = g_std_heap->allocate_at_least(n);
+			return {static_cast<pointer>(r.ptr_), r.size_};
+		}
+		void deallocate(void* p, size_type n) {
+			g_std_heap->free(p, n);
 		}
 
 		pointer address(reference x) const { return &x; }
@@ -0,0 +1,82 @@
+#ifndef H_ABC804B5A6D144E0A9C56B9C9494D832
+#define H_ABC804B5A6D144E0A9C56B9C9494D832
+
+#include <memheap/memheap.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace memheap
+{
+	//epoch based reclamation for lock-free structures over a heap,
+	//readers stay between enter_epoch() and exit_epoch() while they hold pointers to shared nodes,
+	//a retired node goes back to the heap through heap::free_batch() once every thread
+	//that could still see it has left its epoch
+	struct epoch_domain
+	{
+		explicit epoch_domain(heap& h);
+		~epoch_domain(); //frees everything retired, no thread may be inside anymore
+
+		void enter_epoch(); //nests
+		void exit_epoch();
+
+		//p is unlinked and no new reader can get to it, n - its size as with heap::free(p, n),
+		//goes to a bag of the calling thread, every COLLECT_BATCH of them run collect()
+		void retire(void* p, msize n = 0);
+
+		//moves the epoch on if all the threads inside have seen the current one,
+		//and frees the calling thread's bags that are two epochs old
+		void collect();
+
+		//waits until everything retired so far is safe, and frees it along with what
+		//the threads that have exited left behind, the calling thread mustn't be inside
+		void synchronize();
+
+		msize get_epoch() const;
+
+		struct guard
+		{
+			explicit guard(epoch_domain& d)
+				:d_(d)
+			{
+				d_.enter_epoch();
+			}
+
+			~guard()
+			{
+				d_.exit_epoch();
+			}
+
+		private:
+			epoch_domain& d_;
+
+			guard(const guard&) = delete;
+			guard& operator=(const guard&) = delete;
+		};
+
+	private:
+		heap& h_;
+		msize id_; //unique, the thread records are looked up by it
+		std::atomic<msize> epoch_;
+
+		//per thread state, the bags of a thread that has exited wait for the next thread to take its record,
+		//synchronize() or the destructor
+		struct record;
+
+		std::atomic<record*> head_; //all records linked through next_, never removed
+		std::mutex mtx_; //adding and taking records
+		std::vector<std::shared_ptr<record>> records_; //shared with the threads
+
+		record* get_record();
+		std::shared_ptr<record> adopt();
+		void try_advance();
+		void do_collect(record* r);
+		void collect_orphans();
+
+		epoch_domain(const epoch_domain&) = delete;
+		epoch_domain& operator=(const epoch_domain&) = delete;
+	};
+}
+
+#endif
@@ -10,6 +10,13 @@ namespace memheap
     
     typedef unsigned long msize;
 
+	//how a block is picked in the first size class (power of 2) that has one big enough
+	enum class fit_policy : unsigned char
+	{
+		first_fit, //the first in the list, the last freed one goes first
+		best_fit, //the smallest one
+		address_ordered, //the lowest address, the lists are kept in address order, so the chunk ends drain
+	};
 
 	struct heap_chunk
 	{
@@ -19,18 +26,53 @@ namespace memheap
 			void* end_;
 		};
 
+		static const unsigned MAX_BUCKETS = 64;
+
+		//position independent chunk state, so the buffer can be mapped somewhere else next time
+		struct saved_state
+		{
+			msize allocated_space_; //in msize
+			msize clean_;
+			msize user_data_;
+			msize buckets_[MAX_BUCKETS]; //free list heads as offsets from the buffer, 0 - none
+		};
+
 		explicit heap_chunk(msize n); //size in bytes
+
+		//over n bytes of msize aligned zeroed memory that the chunk doesn't own
+		heap_chunk(void* buf, msize n);
+		//picks up a buffer of an earlier chunk, see save()
+		heap_chunk(void* buf, msize n, const saved_state& st);
 		~heap_chunk();
 
+		void save(saved_state& st); //coalesces the quick lists first
+
+		//walks the boundary tags, false if they don't add up, counts the busy blocks
+		bool check(msize* busy = nullptr) const;
+		//free lists and the allocated space from the boundary tags, check() must be true
+		void rebuild();
+
 		void* allocate(msize n);
+		void* allocate_zeroed(msize n); //only clears what has been written to
 		void free(void* p);
+		msize usable_size(void* p) const; //bytes the block of an allocated p can actually hold
+
+		//freed blocks of small sizes are kept whole in exact size lists, up to bytes per list,
+		//all of them get coalesced when a list goes over the budget or a request misses, 0 turns it off
+		void set_quick_budget(msize bytes);
+		void flush_quick(); //coalesce all deferred blocks
+
+		void set_fit_policy(fit_policy p);
+		fit_policy get_fit_policy() const { return fit_; }
 
         //
 		msize get_free_space() const;
         
         //actuall memory would take to allocate less than get_min_alloc_size() bytes,
-        //if the requested memory more than that, the overhead is 2*sizeof(msize)
-		static msize get_min_alloc_size(); ////(~48 bytes on 64bit)
+        //if the requested memory more than that, the overhead is get_block_overhead()
+		static msize get_min_alloc_size(); ////(40 bytes on 64bit, 24 with MEMHEAP_COMPACT_TAGS)
+		static msize get_block_overhead(); //2*sizeof(msize), or sizeof(msize) with MEMHEAP_COMPACT_TAGS
+		static msize get_max_size(); //biggest chunk, 32GB with MEMHEAP_COMPACT_TAGS
 
 		range get_range() const
 		{
@@ -50,14 +92,42 @@ namespace memheap
             return size_ * sizeof(msize);
         }
 
+		//whatever the owner wants to remember about the chunk, 0 initially
+		void set_user_data(msize v) { user_data_ = v; }
+		msize get_user_data() const { return user_data_; }
+
 	private:
         msize allocated_space_;
 		msize* b_; //make sure msize alignment
 		msize size_; //buffer size in msize
+		msize clean_; //nothing at or after this offset (in msize) has been handed out
+		msize user_data_;
+		bool owned_; //b_ is ours to free
 
 		//free lists arranged in size by power of 2
 		std::vector<free_node*> buckets_;  
 
+		struct quick_list
+		{
+			msize* head_; //blocks linked through the start of their user area
+			msize cnt_;
+		};
+
+		std::vector<quick_list> quick_; //by exact block size
+		msize quick_space_; //in msize
+		msize quick_budget_; //bytes per list
+
+		fit_policy fit_;
+
+		void flush_quick(quick_list& q);
+		msize* quick_next(msize* b) const;
+		void release_block(msize* b);
+
+		msize* allocate_block(msize n);
+		free_node* find_fit(msize nw, free_node**& head);
+		void insert_node(free_node*& head, free_node* n);
+		void format();
+
 		heap_chunk(const heap_chunk&) = delete;
 		heap_chunk& operator=(const heap_chunk&) = delete;
 	};
@@ -0,0 +1,104 @@
+#ifndef H_6F0B3C2E9A4D4F7B8E21D5C4A7B90E13
+#define H_6F0B3C2E9A4D4F7B8E21D5C4A7B90E13
+
+#include <cstdint>
+#include <algorithm>
+
+namespace memheap
+{
+	struct latency_percentiles //nanoseconds
+	{
+		std::uint64_t count_;
+		std::uint64_t p50_;
+		std::uint64_t p99_;
+		std::uint64_t p999_;
+		std::uint64_t max_;
+	};
+
+	//HDR style histogram, every power of 2 is split into 16 linear buckets (~6% error)
+	struct latency_histogram
+	{
+		latency_histogram()
+		{
+			reset();
+		}
+
+		void record(std::uint64_t v)
+		{
+			++counts_[index(v)];
+			++count_;
+			max_ = std::max(max_, v);
+		}
+
+		void reset()
+		{
+			std::fill(counts_, counts_ + BUCKETS, 0);
+			count_ = 0;
+			max_ = 0;
+		}
+
+		//the smallest bucket bound that covers q (0..1) of the samples
+		std::uint64_t percentile(double q) const
+		{
+			if (!count_)
+				return 0;
+
+			std::uint64_t rank = static_cast<std::uint64_t>(q * count_ + 0.5);
+			if (!rank)
+				rank = 1;
+
+			std::uint64_t n = 0;
+			for (unsigned i = 0; i != BUCKETS; ++i) {
+				n += counts_[i];
+				if (n >= rank)
+					return std::min(upper_bound(i), max_);
+			}
+			return max_;
+		}
+
+		latency_percentiles get_percentiles() const
+		{
+			latency_percentiles r;
+			r.count_ = count_;
+			r.p50_ = percentile(0.5);
+			r.p99_ = percentile(0.99);
+			r.p999_ = percentile(0.999);
+			r.max_ = max_;
+			return r;
+		}
+
+		std::uint64_t get_count() const { return count_; }
+		std::uint64_t get_max() const { return max_; }
+
+	private:
+		static const unsigned SUB_BITS = 4;
+		static const unsigned SUB_COUNT = 1u << SUB_BITS;
+		static const unsigned BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+		std::uint64_t counts_[BUCKETS];
+		std::uint64_t count_;
+		std::uint64_t max_;
+
+		static unsigned index(std::uint64_t v)
+		{
+			if (v < SUB_COUNT)
+				return static_cast<unsigned>(v);
+
+			unsigned e = 63 - __builtin_clzll(v);
+			unsigned sub = static_cast<unsigned>(v >> (e - SUB_BITS)) - SUB_COUNT;
+			return (e - SUB_BITS + 1) * SUB_COUNT + sub;
+		}
+
+		static std::uint64_t upper_bound(unsigned i)
+		{
+			if (i < SUB_COUNT)
+				return i;
+
+			unsigned e = i / SUB_COUNT + SUB_BITS - 1;
+			std::uint64_t lo = std::uint64_t(SUB_COUNT + i % SUB_COUNT) << (e - SUB_BITS);
+			return lo + (std::uint64_t(1) << (e - SUB_BITS)) - 1;
+		}
+	};
+}
+
+#endif
@@ -4,35 +4,255 @@
 #include <vector>
 #include <mutex>
 #include <memheap/heap_chunk.h>
+#include <memheap/latency_histogram.h>
 #include <memory>
 #include <limits>
+#include <atomic>
+#include <string>
+#include <functional>
 
 namespace memheap
 {
+	struct heap_options
+	{
+		//bytes of same size freed blocks to keep per size in each chunk before coalescing,
+		//0 - coalesce on every free
+		msize quick_list_budget = 0;
+
+		fit_policy fit = fit_policy::first_fit; //how each chunk picks a free block
+
+		//prepared chunks a background thread keeps ready for growth, 0 - no thread
+		msize spare_chunks = 0;
+		//start preparing them once free space drops under this, 0 - one chunk size
+		msize spare_watermark = 0;
+
+		//size each new chunk from the live allocation profile, growing them geometrically with the heap,
+		//est_max_size and est_cnt are only used as initial hints
+		bool adaptive_chunks = false;
+		msize max_chunk_size = 0; //cap for adaptive chunks, 0 - 64MB
+
+		//thread safe heaps only, free() doesn't wait for the lock when another thread holds it,
+		//the block is pushed on a lock-free stack that the lock owner frees in a batch
+		bool deferred_free = false;
+
+		//keep the chunks in this file mapped into memory, a heap opened over an existing file picks up 
+		//where the last one left off (est_max_size and est_cnt are ignored then),
+		//spare_chunks is ignored and empty chunks aren't released
+		std::string file_path;
+		msize file_capacity = 0; //the most the file may grow to, 0 - 64GB
+
+		//the most bytes all chunks may take, allocate() throws std::bad_alloc and try_allocate() returns nullptr
+		//when a request doesn't fit, 0 - no limit, spare_chunks is ignored with a budget,
+		//the first chunk is cut down to fit it, std::invalid_argument if no chunk can
+		msize budget = 0;
+
+		//allocated bytes from which the pressure callbacks get pressure::soft and pressure::hard, 0 - never
+		msize soft_limit = 0;
+		msize hard_limit = 0;
+
+		//requests up to this many bytes (at most 256) are carved without a block header from slabs of 
+		//their size class, the slabs fill chunks of their own for each lifetime class and are never given back,
+		//free(p, n) takes the class from n, free(p) from the slab, ignored with file_path, 0 - off
+		msize small_block_size = 0;
+	};
+
+	//expected lifetime of an allocation, each class gets chunks of its own,
+	//so the short lived churn doesn't pin down the chunks holding the long lived data
+	enum class lifetime : unsigned char
+	{
+		normal,
+		short_lived,
+		long_lived,
+	};
+
+	const unsigned LIFETIME_CLASSES = 3;
+
+	enum class pressure : unsigned char
+	{
+		normal,
+		soft, //at or over heap_options::soft_limit
+		hard, //at or over heap_options::hard_limit
+	};
+
 	struct heap
 	{
 
-		explicit heap(bool thread_safe, msize est_max_size, msize est_cnt); //hint about estimated memory profile
+		explicit heap(bool thread_safe, msize est_max_size, msize est_cnt //hint about estimated memory profile
+				,const heap_options& opt = heap_options());
 		~heap();
 
 		void* allocate(msize n);
+		void* allocate(msize n, lifetime hint);
+		void* allocate_zeroed(msize n); //calloc, fresh memory isn't cleared again
+		void* try_allocate(msize n); //nullptr instead of std::bad_alloc, see heap_options::budget
 		void free(void* p);
+		//n - the size the block was asked for (or up to its usable_size()), 0 - unknown,
+		//a deferred free (see heap_options::deferred_free) only keeps p
+		void free(void* p, msize n);
+		void free_batch(void* const* p, msize cnt); //under one lock, nullptr entries are skipped
+		void free_batch(void* const* p, const msize* n, msize cnt); //n - the sizes as with free(p, n)
+		void flush_frees(); //free the blocks deferred_free left for later
+
+		//blocks are rounded up, and may get the whole free block if the rest is too small for another one,
+		//all of it can be used
+		msize usable_size(void* p) const;
+
+		struct allocation_result
+		{
+			void* ptr_;
+			msize size_; //usable size, at least n
+		};
+
+		allocation_result allocate_at_least(msize n);
+
 		msize get_free_space() const;
+		msize get_spare_chunks() const; //ready for growth, see heap_options::spare_chunks
+		msize get_total_size() const; //all chunks
+		msize get_chunk_count() const;
+		bool is_thread_safe() const { return mtx_ != nullptr; }
+
+		//releases the empty chunks (but the last one), returns the number of bytes released
+		msize trim();
+
+		struct lifetime_stats
+		{
+			msize allocated_; //bytes in the live blocks
+			msize blocks_; //live blocks
+			msize total_size_; //of the class chunks
+			msize chunk_count_;
+		};
+
+		lifetime_stats get_lifetime_stats(lifetime l) const;
+
+		//file backed heap only, see heap_options::file_path, set_root() does nothing otherwise
+		void set_root(void* p); //what get_root() finds after a restart, nullptr - nothing
+		void* get_root() const;
+		bool is_recovered() const; //the file wasn't closed cleanly, the free lists were rebuilt from the boundary tags
+
+		bool check() const; //consistency walk over the boundary tags of all chunks
+
+		//called outside the lock every time the pressure level changes, see heap_options::soft_limit,
+		//a callback may free memory but mustn't throw, it can still be called once right after its removal
+		typedef std::function<void (pressure level, msize allocated)> pressure_callback;
+
+		msize add_pressure_callback(pressure_callback cb); //returns the id to remove it with
+		void remove_pressure_callback(msize id);
+		pressure get_pressure() const;
+
+		//movable allocations, 0 is an invalid handle
+		typedef msize handle;
+
+		handle allocate_handle(msize n);
+		void free_handle(handle h);
+
+		void* pin(handle h); //the block isn't moved until unpinned
+		void unpin(handle h);
+		void* deref(handle h) const; //valid until the next compact() unless pinned
+
+		//moves up to max_bytes of unpinned handle blocks from sparse chunks into denser ones,
+		//and releases the chunks that become empty, returns the number of bytes moved
+		msize compact(msize max_bytes);
+
+		//all zeros unless the library is built with MEMHEAP_LATENCY_STATS (-Dmemheap_latency_stats=ON)
+		struct latency_report
+		{
+			latency_percentiles allocate_;
+			latency_percentiles free_;
+			latency_percentiles lock_wait_;
+			latency_percentiles growth_; //adding a new chunk
+		};
+
+		latency_report get_latency() const;
+		void reset_latency();
 
 	private:
+		heap_options opt_;
 		msize chunk_size_;
 
-		heap_chunk* cur_heap_;
+		heap_chunk* cur_heap_; //last one used
 
 		typedef std::vector<heap_chunk*> chunks;
 
-		chunks hs_;
+		chunks hs_; //all chunks sorted by address
+
+		//chunks of a lifetime class, the class is the chunk user data
+		struct arena
+		{
+			chunks hs_;
+			heap_chunk* cur_; //nullptr until the class gets a chunk
+			msize used_;
+			msize total_;
+			msize blocks_;
+		};
+
+		arena arenas_[LIFETIME_CLASSES];
 		std::mutex* mtx_;
 
+		struct handle_entry
+		{
+			void* p_; //nullptr for a free slot
+			msize size_;
+			msize pins_;
+		};
+
+		msize used_; //allocated bytes in all chunks
+		msize total_; //size of all chunks
+
+		std::vector<msize> live_sizes_; //live blocks by log2 of size, adaptive_chunks only
+
+		struct provisioner;
+		provisioner* prov_;
+
+		struct latency_data;
+		latency_data* lat_;
+
+		std::atomic<void*> pending_; //deferred frees linked through their first word
+
+		struct backing_file;
+		backing_file* file_;
+
+		std::vector<std::pair<msize, pressure_callback>> callbacks_;
+		msize callback_id_;
+		pressure level_; //last one the callbacks have been told about
+
+		struct pressure_event;
+
+		struct small_blocks;
+		small_blocks* small_;
+
+		std::vector<handle_entry> handles_;
+		std::vector<handle> free_handles_;
+
 		heap(const heap&) = delete;
 		heap& operator=(const heap&) = delete;
         
-        void* do_allocate(msize n);
+        void* do_allocate(msize n, bool zeroed = false, lifetime l = lifetime::normal);
+		void* do_try_allocate(msize n, bool zeroed, lifetime l); //nullptr when over the budget
+		void* block_allocate(msize n, bool zeroed, lifetime l); //never a small block
+		void* small_allocate(msize n, bool zeroed, lifetime l); //nullptr when there's no room for a slab
+		char* new_slab(lifetime l, msize cls);
+		void* chunk_allocate(heap_chunk* c, msize n, bool zeroed);
+		void chunk_free(heap_chunk* c, void* p);
+		void do_free(void* p, msize n = 0);
+		void drain_frees();
+		pressure get_level() const;
+		void check_pressure(pressure_event& ev);
+
+		heap_chunk* make_chunk(msize n) const;
+		msize get_max_chunk_size() const;
+		msize get_chunk_slack() const; //what a chunk takes over its size
+		void adapt_chunk_size();
+		heap_chunk* take_spare(msize n);
+		void request_spare();
+		void provision();
+		void open_file(msize chunkcnt);
+		void close_file();
+		heap_chunk* map_chunk(msize n, lifetime l);
+		heap_chunk* find_chunk(void* p) const;
+		msize usable_size_locked(void* p) const;
+		void add_chunk(heap_chunk* c, lifetime l);
+		void release_chunk(heap_chunk* c);
+		msize do_trim();
 	};
 }
 
@@ -0,0 +1,145 @@
+#ifndef H_3B8E5D1F6A2C4E97B0D4F18C2A6E9D57
+#define H_3B8E5D1F6A2C4E97B0D4F18C2A6E9D57
+
+#include <memheap/allocator.h>
+#include <mutex>
+#include <cstdint>
+
+namespace memheap
+{
+	//free nodes of one size linked through their first word, refilled in slabs from g_std_heap,
+	//the slabs are kept until the heap goes away (free_std_allocator())
+	template <size_t S, size_t A>
+	struct node_pool
+	{
+		static node_pool& instance()
+		{
+			static node_pool p;
+			return p;
+		}
+
+		void* pop()
+		{
+			std::unique_lock<std::mutex> lk(mtx_, std::defer_lock);
+			if (g_std_heap->is_thread_safe())
+				lk.lock();
+
+			if (gen_ != g_std_heap_generation) { //the old heap is gone with its slabs
+				head_ = nullptr;
+				slab_ = MIN_SLAB;
+				gen_ = g_std_heap_generation;
+			}
+			if (!head_)
+				refill();
+
+			void* p = head_;
+			head_ = *static_cast<void**>(p);
+			return p;
+		}
+
+		void push(void* p)
+		{
+			std::unique_lock<std::mutex> lk(mtx_, std::defer_lock);
+			if (g_std_heap->is_thread_safe())
+				lk.lock();
+
+			if (gen_ != g_std_heap_generation)
+				return;
+			*static_cast<void**>(p) = head_;
+			head_ = p;
+		}
+
+	private:
+		static const size_t ALIGN = A > alignof(void*)? A: alignof(void*);
+		static const size_t NODE = ((S > sizeof(void*)? S: sizeof(void*)) + ALIGN - 1) / ALIGN * ALIGN;
+		static const msize MIN_SLAB = 64; //nodes
+		static const msize MAX_SLAB = 4096;
+
+		std::mutex mtx_;
+		void* head_;
+		unsigned long gen_;
+		msize slab_; //nodes in the next slab
+
+		node_pool()
+			:head_(nullptr)
+			,gen_(0)
+			,slab_(MIN_SLAB)
+		{}
+
+		void refill()
+		{
+			char* s = static_cast<char*>(g_std_heap->allocate(slab_ * NODE + ALIGN - 1));
+			s = reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(s) + ALIGN - 1) & ~std::uintptr_t(ALIGN - 1));
+
+			for (msize i = slab_; i != 0; --i) {
+				void* p = s + (i - 1) * NODE;
+				*static_cast<void**>(p) = head_;
+				head_ = p;
+			}
+			if (slab_ < MAX_SLAB)
+				slab_ *= 2;
+		}
+
+		node_pool(const node_pool&) = delete;
+		node_pool& operator=(const node_pool&) = delete;
+	};
+
+	//single objects (the nodes of std::map, std::list, std::unordered_map...) come from a node_pool
+	//of their size without any block overhead, arrays go to allocator
+	template <typename T>
+	struct pool_allocator
+	{
+		typedef size_t    size_type;
+		typedef ptrdiff_t difference_type;
+		typedef T*        pointer;
+		typedef const T*  const_pointer;
+		typedef T&        reference;
+		typedef const T&  const_reference;
+		typedef T         value_type;
+
+		pool_allocator() {}
+		pool_allocator(const pool_allocator&) {}
+
+		template <class U>
+			pool_allocator(const pool_allocator<U>&) {}
+
+		pointer allocate(size_type n, const void * = 0)
+		{
+			if (n == 1)
+				return static_cast<pointer>(node_pool<sizeof(T), alignof(T)>::instance().pop());
+			return allocator<T>().allocate(n);
+		}
+
+		void deallocate(pointer p, size_type n)
+		{
+			if (n == 1)
+				node_pool<sizeof(T), alignof(T)>::instance().push(p);
+			else
+				allocator<T>().deallocate(p, n);
+		}
+
+		size_type max_size() const { return std::numeric_limits<msize>::max(); }
+
+		pool_allocator& operator=(const pool_allocator&)
+		{
+			return *this;
+		}
+
+		template <class U>
+			bool operator==(const pool_allocator<U>&) const
+			{
+				return true;
+			}
+
+		template <class U>
+			bool operator!=(const pool_allocator<U>&) const
+			{
+				return false;
+			}
+
+		template <class U>
+			struct rebind { typedef pool_allocator<U> other; };
+	};
+};
+
+#endif
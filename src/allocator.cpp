@@ -4,11 +4,13 @@
 namespace memheap
 {
 	heap* g_std_heap = {nullptr};
+	unsigned long g_std_heap_generation = {0};
 
-	void init_std_allocator(bool thread_safe, msize est_max_size, msize est_cnt)
+	void init_std_allocator(bool thread_safe, msize est_max_size, msize est_cnt, const heap_options& opt)
 	{
 		assert(!g_std_heap);
-		g_std_heap = new heap(thread_safe, est_max_size, est_cnt);
+		g_std_heap = new heap(thread_safe, est_max_size, est_cnt, opt);
+		++g_std_heap_generation;
 	}
 
 	void free_std_allocator()
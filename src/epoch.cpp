@@ -0,0 +1,221 @@
+#include <memheap/epoch.h>
+#include <algorithm>
+#include <thread>
+#include <assert.h>
+
+using namespace memheap;
+
+namespace
+{
+	const msize EPOCH_BAGS = 3; //retired in e, e-1, and e-2 that is safe to free
+	const msize COLLECT_BATCH = 128;
+
+	std::atomic<msize> g_domain_id{0};
+
+	struct bag
+	{
+		msize epoch_;
+		std::vector<void*> ptrs_;
+		std::vector<msize> sizes_; //0 - unknown
+	};
+
+	void release(heap& h, bag& b)
+	{
+		if (b.ptrs_.empty())
+			return;
+		h.free_batch(b.ptrs_.data(), b.sizes_.data(), b.ptrs_.size());
+		b.ptrs_.clear();
+		b.sizes_.clear();
+	}
+}
+
+struct epoch_domain::record
+{
+	std::atomic<msize> local_; //epoch << 1 | 1 while inside, 0 - outside
+	std::atomic<bool> owned_; //by a live thread
+	std::atomic<bool> orphan_; //the domain is gone
+	record* next_;
+	msize depth_; //nested enter_epoch()
+	bag bags_[EPOCH_BAGS]; //by epoch % EPOCH_BAGS
+};
+
+epoch_domain::epoch_domain(heap& h)
+	:h_(h)
+	,id_(++g_domain_id)
+	,epoch_(EPOCH_BAGS)
+	,head_(nullptr)
+{}
+
+epoch_domain::~epoch_domain()
+{
+	for (auto& r: records_) { //the ones of the threads that have exited too
+		assert(!(r->local_.load() & 1));
+		for (auto& b: r->bags_) {
+			release(h_, b);
+		}
+		r->orphan_.store(true, std::memory_order_release);
+	}
+}
+
+epoch_domain::record* epoch_domain::get_record()
+{
+	//the records of a thread by domain id
+	struct thread_records
+	{
+		std::vector<std::pair<msize, std::shared_ptr<record>>> v_;
+
+		~thread_records()
+		{
+			for (auto& e: v_) {
+				e.second->owned_.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	static thread_local thread_records t;
+
+	for (auto& e: t.v_) {
+		if (e.first == id_)
+			return e.second.get();
+	}
+
+	//drop what the domains that are gone left behind
+	t.v_.erase(std::remove_if(t.v_.begin(), t.v_.end(),
+				[](const std::pair<msize, std::shared_ptr<record>>& e) -> bool { return e.second->orphan_.load(std::memory_order_acquire); }),
+			t.v_.end());
+
+	std::shared_ptr<record> r = adopt();
+	t.v_.push_back({id_, r});
+	return r.get();
+}
+
+std::shared_ptr<epoch_domain::record> epoch_domain::adopt()
+{
+	std::lock_guard<std::mutex> lk(mtx_);
+
+	for (auto& v: records_) { //of a thread that has exited, bags and all
+		bool owned = false;
+		if (v->owned_.compare_exchange_strong(owned, true, std::memory_order_acquire))
+			return v;
+	}
+
+	std::shared_ptr<record> r(new record);
+	r->local_ = 0;
+	r->owned_ = true;
+	r->orphan_ = false;
+	r->next_ = head_.load(std::memory_order_relaxed);
+	r->depth_ = 0;
+	for (auto& b: r->bags_) {
+		b.epoch_ = 0;
+	}
+
+	records_.reserve(records_.size() + 1);
+	head_.store(r.get(), std::memory_order_release);
+	records_.push_back(r);
+	return r;
+}
+
+void epoch_domain::enter_epoch()
+{
+	record* r = get_record();
+	if (r->depth_++)
+		return;
+	r->local_.store(epoch_.load() << 1 | 1);
+}
+
+void epoch_domain::exit_epoch()
+{
+	record* r = get_record();
+	assert(r->depth_);
+	if (--r->depth_)
+		return;
+	r->local_.store(0, std::memory_order_release);
+}
+
+void epoch_domain::retire(void* p, msize n)
+{
+	if (!p)
+		return;
+
+	record* r = get_record();
+	msize e = epoch_.load(); //after p has been unlinked
+
+	bag& b = r->bags_[e % EPOCH_BAGS];
+	if (b.epoch_ != e) { //three or more epochs old
+		release(h_, b);
+		b.epoch_ = e;
+	}
+	b.sizes_.reserve(b.ptrs_.size() + 1); //both or neither
+	b.ptrs_.push_back(p);
+	b.sizes_.push_back(n);
+
+	if (b.ptrs_.size() % COLLECT_BATCH == 0)
+		do_collect(r);
+}
+
+void epoch_domain::collect()
+{
+	do_collect(get_record());
+}
+
+msize epoch_domain::get_epoch() const
+{
+	return epoch_.load();
+}
+
+void epoch_domain::synchronize()
+{
+	record* r = get_record();
+	assert(!r->depth_);
+
+	//two epochs on, no thread can be inside one that saw what's retired now
+	msize target = epoch_.load() + 2;
+	for (;;) {
+		try_advance();
+		if (epoch_.load() >= target)
+			break;
+		std::this_thread::yield();
+	}
+
+	do_collect(r);
+	collect_orphans();
+}
+
+void epoch_domain::collect_orphans()
+{
+	std::lock_guard<std::mutex> lk(mtx_);
+
+	msize e = epoch_.load();
+	for (auto& v: records_) {
+		bool owned = false; //hold it like adopt() does, while its bags are freed
+		if (!v->owned_.compare_exchange_strong(owned, true, std::memory_order_acquire))
+			continue;
+		for (auto& b: v->bags_) {
+			if (b.epoch_ + 2 <= e)
+				release(h_, b);
+		}
+		v->owned_.store(false, std::memory_order_release);
+	}
+}
+
+void epoch_domain::try_advance()
+{
+	msize e = epoch_.load();
+	for (record* r = head_.load(std::memory_order_acquire); r; r = r->next_) {
+		msize l = r->local_.load();
+		if ((l & 1) && (l >> 1) != e)
+			return; //still inside an older one
+	}
+	epoch_.compare_exchange_strong(e, e + 1);
+}
+
+void epoch_domain::do_collect(record* r)
+{
+	try_advance();
+
+	msize e = epoch_.load();
+	for (auto& b: r->bags_) {
+		if (b.epoch_ + 2 <= e) //nobody inside has seen them
+			release(h_, b);
+	}
+}
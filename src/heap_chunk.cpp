@@ -4,6 +4,13 @@
 #include <memory>
 #include <cstring>
 #include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <limits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace memheap;
 
@@ -24,21 +31,33 @@ namespace memheap
 	 * |   ...      |
 	 * |    0       |
 	 *
-	 * min block size = sizeof(free_node) + alignof(free_node) + 2 * sizeof(msize)
+	 * A block on a quick list stays busy, with QUICK_TAG at its end instead of 0,
+	 * so rebuild() can tell it from the ones in use.
+	 *
+	 * min block size = sizeof(free_node) + alignof(free_node) + 2 * sizeof(tag)
+	 *
+	 * Blocks are counted in msize units. The size markers (tags) are msize, 
+	 * or 32 bit with MEMHEAP_COMPACT_TAGS. A compact block starts 4 bytes before an msize boundary,
+	 * so its user area stays msize aligned, and both markers take just one msize.
 	 */
 
+#ifdef MEMHEAP_COMPACT_TAGS
+	typedef std::uint32_t tag;
+#else
+	typedef msize tag;
+#endif
+
+	//the links are offsets from the chunk buffer, 0 - none
 	struct free_node
 	{
-		msize* start_;
-		msize size_; //in msize units
-		free_node* prev_;
-		free_node* next_;
-
-		explicit free_node(msize* start, msize sz) 
-			:start_(start)
-			,size_(sz)
-			,prev_(nullptr)
-			,next_(nullptr)
+		tag size_; //in msize units
+		tag prev_;
+		tag next_;
+
+		explicit free_node(msize sz) 
+			:size_(static_cast<tag>(sz))
+			,prev_(0)
+			,next_(0)
 		{}
 	};
 }
@@ -46,43 +65,103 @@ namespace memheap
 namespace
 {
 	using memheap::msize;
-
-	const static msize NODE_ALIGN = (alignof(free_node) == alignof(msize))? 0: alignof(free_node); //already aligning as msize
-	const static msize MIN_BLOCK_SIZE_BYTES_t = (sizeof(free_node) + NODE_ALIGN + 2*sizeof(msize));
-	const static msize MIN_BLOCK_SIZE = ((MIN_BLOCK_SIZE_BYTES_t % sizeof(msize))? MIN_BLOCK_SIZE_BYTES_t + 1: MIN_BLOCK_SIZE_BYTES_t)/sizeof(msize);
+	using memheap::tag;
+
+#ifdef MEMHEAP_COMPACT_TAGS
+	const static msize FIRST_BLOCK = 1; //the first block's size marker is in the upper half of b_[0]
+
+	inline tag& head_tag(msize* b) { return reinterpret_cast<tag*>(b)[-1]; }
+	inline tag& foot_tag(msize* b, msize n) { return reinterpret_cast<tag*>(b + n - 1)[0]; }
+	inline tag prev_foot_tag(msize* b) { return reinterpret_cast<tag*>(b)[-2]; }
+	inline msize* user_area(msize* b) { return b; }
+	inline msize* block_of(void* p) { return reinterpret_cast<msize*>(p); }
+#else
+	const static msize FIRST_BLOCK = 0;
+
+	inline tag& head_tag(msize* b) { return b[0]; }
+	inline tag& foot_tag(msize* b, msize n) { return b[n-1]; }
+	inline tag prev_foot_tag(msize* b) { return b[-1]; }
+	inline msize* user_area(msize* b) { return b + 1; }
+	inline msize* block_of(void* p) { return reinterpret_cast<msize*>(p) - 1; }
+#endif
+
+	const static tag QUICK_TAG = std::numeric_limits<tag>::max(); //the end marker of a block on a quick list
+	const static msize MAX_BLOCK_SIZE = QUICK_TAG - 1; //in msize, a free block's end marker is never QUICK_TAG
+	const static msize BLOCK_OVERHEAD_BYTES = 2*sizeof(tag);
+	const static msize NODE_ALIGN = (alignof(free_node) <= alignof(msize))? 0: alignof(free_node); //already aligning as msize
+	const static msize MIN_BLOCK_SIZE_BYTES_t = (sizeof(free_node) + NODE_ALIGN + BLOCK_OVERHEAD_BYTES);
+	const static msize MIN_BLOCK_SIZE = (MIN_BLOCK_SIZE_BYTES_t + sizeof(msize) - 1)/sizeof(msize);
 	const static msize MIN_BLOCK_SIZE_BYTES = MIN_BLOCK_SIZE * sizeof(msize);
 
+	//words that make_free_node() writes at the start of the user area
+	const static msize NODE_WORDS = (sizeof(free_node) + sizeof(msize) - 1)/sizeof(msize);
+
+	//exact size lists for blocks of MIN_BLOCK_SIZE ... MIN_BLOCK_SIZE + QUICK_LISTS - 1 (in msize)
+	const static msize QUICK_LISTS = 128;
 
-	template <typename T> inline
-		T* place_aligned(void* p, std::size_t sz, std::size_t a = alignof(T))
-		{
-			if (!std::align(a, sizeof(T), p, sz))
-				return nullptr;
-			return reinterpret_cast<T*>(p);
+	//clear with non-temporal stores from this size on, so big buffers don't evict the cache
+	const static std::size_t STREAM_CLEAR_BYTES = 256*1024;
+
+	void clear_memory(void* p, std::size_t n)
+	{
+#if defined(__SSE2__)
+		if (n >= STREAM_CLEAR_BYTES) {
+			char* c = reinterpret_cast<char*>(p);
+			std::size_t head = (16 - (reinterpret_cast<std::uintptr_t>(c) & 15)) & 15;
+			std::memset(c, 0, head);
+			c += head;
+			n -= head;
+
+			const __m128i z = _mm_setzero_si128();
+			for (; n >= 64; n -= 64, c += 64) {
+				_mm_stream_si128(reinterpret_cast<__m128i*>(c), z);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(c + 16), z);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(c + 32), z);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(c + 48), z);
+			}
+			_mm_sfence();
+			std::memset(c, 0, n);
+			return;
 		}
+#endif
+		std::memset(p, 0, n);
+	}
+
+
+	inline free_node* get_free_node(msize* b)
+	{
+		return reinterpret_cast<free_node*>(user_area(b));
+	}
+
+	inline msize* node_block(free_node* n)
+	{
+		return block_of(n);
+	}
+
+	inline free_node* node_at(msize* base, tag off)
+	{
+		return off? reinterpret_cast<free_node*>(base + off): nullptr;
+	}
 
-	inline free_node* get_free_node(msize* b, msize n)
+	inline tag node_offset(msize* base, free_node* n)
 	{
-		std::size_t sz = (n - 2)*sizeof(msize);
-		return place_aligned<free_node>(b + 1, sz);
+		return n? static_cast<tag>(reinterpret_cast<msize*>(n) - base): 0;
 	}
 
 	free_node* make_free_node(msize* p, msize n)
 	{
-		assert(n);
+		assert(n >= MIN_BLOCK_SIZE && n <= MAX_BLOCK_SIZE);
 
-		*p = 0;
-		std::size_t sz = sizeof(msize) + MIN_BLOCK_SIZE_BYTES;
-		free_node* r = place_aligned<free_node>(p + 1, sz); //(n - 2)*sizeof(msize));
+		head_tag(p) = 0;
+		free_node* r = get_free_node(p);
 
-		assert(r);
 		//make sure that we have enough space for the end marker
 		//MIN_BLOCK_SIZE must ensure this condition
-		assert(reinterpret_cast<char*>(r) + sizeof(free_node) < reinterpret_cast<char*>(p + n));
+		assert(reinterpret_cast<char*>(r) + sizeof(free_node) <= reinterpret_cast<char*>(&foot_tag(p, n)));
 
-		p[n-1] = n; //put the size at the block's end
+		foot_tag(p, n) = static_cast<tag>(n); //put the size at the block's end
 
-		return new(r) free_node(p, n);
+		return new(r) free_node(n);
 	}
 
 
@@ -98,25 +177,50 @@ namespace
 		return r;
 	}
 
-	void remove_node(free_node*& head, free_node* n)
+	void remove_node(msize* base, free_node*& head, free_node* n)
 	{
 		assert(n);
-		if (!n->prev_) {
-			head = n->next_;
+		free_node* prev = node_at(base, n->prev_);
+		free_node* next = node_at(base, n->next_);
+
+		if (!prev) {
+			head = next;
 			if (head)
-				head->prev_ = nullptr;
+				head->prev_ = 0;
 			return;
 		}
 
-		assert(n->prev_->next_ == n);
+		assert(node_at(base, prev->next_) == n);
 
-		n->prev_->next_ = n->next_;
-		if (n->next_)
-			n->next_->prev_ = n->prev_;
+		prev->next_ = n->next_;
+		if (next)
+			next->prev_ = n->prev_;
 		return;
 
 	}
-	void add_node(free_node*& head, free_node* n)
+	free_node* find_node(msize* base, std::vector<free_node*>& buckets, msize nw, free_node**& head)
+	{
+		msize ln = log2(nw);
+		assert(ln < buckets.size());
+
+		head = buckets.data() + ln;
+		free_node** end = buckets.data() + buckets.size();
+
+		free_node* fn = {};
+
+		for(; head != end; ++head) {
+			fn = *head;
+			for (; fn; fn = node_at(base, fn->next_)) {
+				if (fn->size_ >= nw)
+					break;
+			}
+			if (fn)
+				break;
+		}
+		return fn;
+	}
+
+	void add_node(msize* base, free_node*& head, free_node* n)
 	{
 		assert(n);
 		if (!head) {
@@ -125,46 +229,256 @@ namespace
 			return;
 		}
 
-		n->next_ = head;
-		head->prev_ = n;
+		n->next_ = node_offset(base, head);
+		head->prev_ = node_offset(base, n);
 		head = n;
-		n->prev_ = nullptr;
+		n->prev_ = 0;
+	}
+
+	//the smallest node that fits in the first bucket that has one
+	free_node* find_best_node(msize* base, std::vector<free_node*>& buckets, msize nw, free_node**& head)
+	{
+		msize ln = log2(nw);
+		assert(ln < buckets.size());
+
+		head = buckets.data() + ln;
+		free_node** end = buckets.data() + buckets.size();
+
+		free_node* fn = {};
+
+		for(; head != end; ++head) {
+			for (free_node* v = *head; v; v = node_at(base, v->next_)) {
+				if (v->size_ >= nw && (!fn || v->size_ < fn->size_)) {
+					fn = v;
+					if (fn->size_ == nw) //can't do better
+						return fn;
+				}
+			}
+			if (fn)
+				break;
+		}
+		return fn;
+	}
+
+	//keeps the list in address order
+	void add_node_ordered(msize* base, free_node*& head, free_node* n)
+	{
+		assert(n);
+		if (!head || n < head) {
+			add_node(base, head, n);
+			return;
+		}
+
+		free_node* prev = head;
+		for (free_node* v = node_at(base, prev->next_); v && v < n; v = node_at(base, v->next_)) {
+			prev = v;
+		}
+
+		n->prev_ = node_offset(base, prev);
+		n->next_ = prev->next_;
+		if (n->next_)
+			node_at(base, n->next_)->prev_ = node_offset(base, n);
+		prev->next_ = node_offset(base, n);
 	}
 }
 
 
 heap_chunk::heap_chunk(msize n)
 	:allocated_space_(0)
+	,clean_(0)
+	,user_data_(0)
+	,owned_(true)
+	,quick_space_(0)
+	,quick_budget_(0)
+	,fit_(fit_policy::first_fit)
 {
 	assert(n);
 
 	size_ = std::max(n, MIN_BLOCK_SIZE_BYTES) / sizeof(msize) + 3;
-	b_ = new msize[size_];
+	if (size_ - FIRST_BLOCK > MAX_BLOCK_SIZE)
+		throw std::bad_alloc();
+
+	//allocate_zeroed() relies on the buffer starting out zeroed, the prefault below
+	//writes zeros, so it stays that way, but every page gets committed
+	b_ = static_cast<msize*>(std::calloc(size_, sizeof(msize)));
+	if (!b_)
+		throw std::bad_alloc();
 
 	//this will allocate physical memory as much as possible 
 	for (msize i = 0; i < size_; i += MIN_BLOCK_SIZE*4) {
-		b_[i] = 0;
+		reinterpret_cast<char*>(b_ + i)[0] = 0;
 	}
 	//memset(b_, 0xcd, sizeof(msize)*size_);
 
-	msize lnum = log2(size_);
+	format();
+}
 
-	buckets_.resize(lnum+1, nullptr);
+heap_chunk::heap_chunk(void* buf, msize n)
+	:allocated_space_(0)
+	,b_(static_cast<msize*>(buf))
+	,size_(n / sizeof(msize))
+	,clean_(0)
+	,user_data_(0)
+	,owned_(false)
+	,quick_space_(0)
+	,quick_budget_(0)
+	,fit_(fit_policy::first_fit)
+{
+	assert(!(reinterpret_cast<std::uintptr_t>(buf) % alignof(msize)));
+
+	if (size_ < MIN_BLOCK_SIZE + FIRST_BLOCK || size_ - FIRST_BLOCK > MAX_BLOCK_SIZE)
+		throw std::bad_alloc();
+
+	format();
+}
+
+heap_chunk::heap_chunk(void* buf, msize n, const saved_state& st)
+	:allocated_space_(st.allocated_space_)
+	,b_(static_cast<msize*>(buf))
+	,size_(n / sizeof(msize))
+	,clean_(st.clean_)
+	,user_data_(st.user_data_)
+	,owned_(false)
+	,quick_space_(0)
+	,quick_budget_(0)
+	,fit_(fit_policy::first_fit)
+{
+	assert(size_ >= MIN_BLOCK_SIZE + FIRST_BLOCK && size_ - FIRST_BLOCK <= MAX_BLOCK_SIZE);
 
-	buckets_[lnum] = make_free_node(b_, size_);
+	buckets_.resize(log2(size_ - FIRST_BLOCK) + 1, nullptr);
+	for (msize i = 0; i != buckets_.size(); ++i) {
+		buckets_[i] = node_at(b_, static_cast<tag>(st.buckets_[i]));
+	}
 }
 
 heap_chunk::~heap_chunk()
 {
-	delete[] b_;
+	if (owned_)
+		std::free(b_);
+}
+
+void heap_chunk::format()
+{
+	msize n0 = size_ - FIRST_BLOCK;
+	msize lnum = log2(n0);
+
+	buckets_.resize(lnum+1, nullptr);
+
+	buckets_[lnum] = make_free_node(b_ + FIRST_BLOCK, n0);
+}
+
+void heap_chunk::save(saved_state& st)
+{
+	flush_quick();
+
+	st.allocated_space_ = allocated_space_;
+	st.clean_ = clean_;
+	st.user_data_ = user_data_;
+	std::fill(st.buckets_, st.buckets_ + MAX_BUCKETS, 0);
+	for (msize i = 0; i != buckets_.size(); ++i) {
+		st.buckets_[i] = node_offset(b_, buckets_[i]);
+	}
+}
+
+bool heap_chunk::check(msize* busy) const
+{
+	msize cnt = 0;
+	msize i = FIRST_BLOCK;
+	while (i < size_) {
+		msize* b = b_ + i;
+		msize n = head_tag(b);
+		bool isfree = !n;
+		if (isfree) {
+			if (size_ - i < MIN_BLOCK_SIZE)
+				return false;
+			n = get_free_node(b)->size_;
+		}
+
+		if (n < MIN_BLOCK_SIZE || n > size_ - i)
+			return false;
+		tag foot = foot_tag(b, n);
+		if (isfree? foot != n: foot && foot != QUICK_TAG)
+			return false;
+		if (!isfree && !foot)
+			++cnt;
+		i += n;
+	}
+	if (busy)
+		*busy = cnt;
+	return i == size_;
+}
+
+void heap_chunk::rebuild()
+{
+	assert(check());
+
+	quick_list q = {nullptr, 0};
+	std::fill(quick_.begin(), quick_.end(), q);
+	quick_space_ = 0;
+	std::fill(buckets_.begin(), buckets_.end(), nullptr);
+	allocated_space_ = 0;
+
+	for (msize i = FIRST_BLOCK; i < size_;) {
+		msize* b = b_ + i;
+		msize n = head_tag(b);
+		if (n && !foot_tag(b, n)) {
+			allocated_space_ += n;
+			i += n;
+			continue;
+		}
+
+		//free, or on a quick list when the state was lost, merged with the ones that follow
+		msize r = 0;
+		for (msize* e = b; i + r < size_; e = b + r) {
+			n = head_tag(e);
+			if (n && !foot_tag(e, n))
+				break;
+			r += n? n: get_free_node(e)->size_;
+		}
+		insert_node(buckets_[log2(r)], make_free_node(b, r));
+		i += r;
+	}
+
+	clean_ = size_; //nothing is known to be clean anymore
 }
 
 void* heap_chunk::allocate(msize nb)
+{
+	msize* buf = allocate_block(nb);
+	if (!buf)
+		return nullptr;
+
+	clean_ = std::max(clean_, msize(buf - b_) + head_tag(buf));
+	return user_area(buf);
+}
+
+void* heap_chunk::allocate_zeroed(msize nb)
+{
+	msize* buf = allocate_block(nb);
+	if (!buf)
+		return nullptr;
+
+	msize nw = head_tag(buf);
+	msize* p = user_area(buf);
+
+	//everything from clean_ on has never been handed out, except the free node
+	//written at the start of the block we've just taken
+	msize* end = buf + nw - 1;
+	msize* dirty = std::min(end, std::max(b_ + clean_, p + NODE_WORDS));
+
+	if (dirty > p)
+		clear_memory(p, (dirty - p)*sizeof(msize));
+
+	clean_ = std::max(clean_, msize(buf - b_) + nw);
+	return p;
+}
+
+msize* heap_chunk::allocate_block(msize nb)
 {
 	if (!nb)
 		return nullptr;
 
-	msize nw = std::max(nb + msize(2*sizeof(msize)) //place for block markers
+	msize nw = std::max(nb + BLOCK_OVERHEAD_BYTES //place for block markers
 			,MIN_BLOCK_SIZE_BYTES);
 
 	nw = (nw % sizeof(msize))? nw/sizeof(msize) + 1: nw/sizeof(msize);
@@ -176,94 +490,204 @@ void* heap_chunk::allocate(msize nb)
 	if (nw > size_)
 		return nullptr;
 
-	msize ln = log2(nw);
-	assert(ln < buckets_.size());
-
-	free_node** head = buckets_.data() + ln;
-	free_node** end = buckets_.data() + buckets_.size();
+	if (nw - MIN_BLOCK_SIZE < quick_.size()) {
+		quick_list& q = quick_[nw - MIN_BLOCK_SIZE];
+		if (q.head_) { //same size block freed recently
+			msize* buf = q.head_;
+			q.head_ = quick_next(buf);
+			--q.cnt_;
+			quick_space_ -= nw;
+			allocated_space_ += nw;
+			foot_tag(buf, nw) = 0;
+			return buf;
+		}
+	}
 
-	free_node* fn = {};
+	free_node** head = {};
+	free_node* fn = find_fit(nw, head);
 
-	for(; head != end; ++head) {
-		fn = *head;
-		for (; fn; fn = fn->next_) {
-			if (fn->size_ >= nw)
-				break;
-		}
-		if (fn)
-			break;
+	if (!fn && quick_space_) { //coalesce what's been deferred and try again
+		flush_quick();
+		fn = find_fit(nw, head);
 	}
 
 	if (!fn)
 		return nullptr;
 
-	msize* buf = fn->start_;
+	msize* buf = node_block(fn);
 	//should we split the free block or just use the whole thing
 	msize rmnd = fn->size_ - nw;
 
 	if (rmnd < MIN_BLOCK_SIZE) { //use the whole thing
 		nw = fn->size_;
-		remove_node(*head, fn);
+		remove_node(b_, *head, fn);
 	}
 	else {
-		remove_node(*head, fn);
-		add_node(buckets_[log2(rmnd)], make_free_node(buf + nw, rmnd));
+		remove_node(b_, *head, fn);
+		insert_node(buckets_[log2(rmnd)], make_free_node(buf + nw, rmnd));
 	}
 
 	//mark the busy block
 	assert(nw >= MIN_BLOCK_SIZE);
-	*buf = nw;
-	buf[nw-1] = 0;
+	head_tag(buf) = static_cast<tag>(nw);
+	foot_tag(buf, nw) = 0;
 
 	allocated_space_ += nw;
 
-	return buf + 1;
+	return buf;
+}
+
+msize* heap_chunk::quick_next(msize* b) const
+{
+	tag off = *reinterpret_cast<tag*>(user_area(b));
+	return off? block_of(b_ + off): nullptr;
 }
 
 void heap_chunk::free(void* p)
 {
-	msize* b = reinterpret_cast<msize*>(p) - 1;
+	msize* b = block_of(p);
 
-	msize n = *b;
+	msize n = head_tag(b);
 	assert(n);
 	allocated_space_ -= n;
-	assert(!b[n-1]); //must be 0
+	assert(!foot_tag(b, n)); //must be 0
+
+	if (n - MIN_BLOCK_SIZE < quick_.size()) { //keep it whole, the block stays marked busy
+		quick_list& q = quick_[n - MIN_BLOCK_SIZE];
+		*reinterpret_cast<tag*>(user_area(b)) = q.head_? static_cast<tag>(user_area(q.head_) - b_): 0;
+		foot_tag(b, n) = QUICK_TAG;
+		q.head_ = b;
+		++q.cnt_;
+		quick_space_ += n;
+
+		if (q.cnt_ * n * sizeof(msize) > quick_budget_) {
+			flush_quick();
+		}
+		return;
+	}
+
+	release_block(b);
+}
+
+void heap_chunk::set_quick_budget(msize bytes)
+{
+	quick_budget_ = bytes;
+	if (!bytes) {
+		flush_quick();
+		quick_.clear();
+		return;
+	}
+	quick_list q = {nullptr, 0};
+	quick_.resize(QUICK_LISTS, q);
+}
+
+void heap_chunk::flush_quick()
+{
+	for (auto& q: quick_) {
+		flush_quick(q);
+	}
+}
+
+void heap_chunk::flush_quick(quick_list& q)
+{
+	while (q.head_) {
+		msize* b = q.head_;
+		q.head_ = quick_next(b);
+		quick_space_ -= head_tag(b);
+		release_block(b);
+	}
+	q.cnt_ = 0;
+}
 
+void heap_chunk::release_block(msize* b)
+{
+	msize n = head_tag(b);
 
 	//is space before free
 	//
 
-	if (b_ != b) { //not at the chunk start
-		msize sz =  *(b - 1);
+	if (b_ + FIRST_BLOCK != b) { //not at the chunk start
+		msize sz = prev_foot_tag(b);
 
-		if (sz) { //have a free block of just befor this one
+		if (sz && sz != QUICK_TAG) { //have a free block of just befor this one
 			b = b - sz;
 			n += sz;
 
-			free_node* r = get_free_node(b, sz);
+			free_node* r = get_free_node(b);
 			assert(r->size_ == sz);
-			remove_node(buckets_[log2(sz)], r);
+			remove_node(b_, buckets_[log2(sz)], r);
 		}
 	}
 
 	//now check the next block
 	if (b + n < b_ + size_) {
-		if (!*(b + n)) { //free block after...
-			free_node* r = get_free_node(b + n, MIN_BLOCK_SIZE);
-			assert( (b+n)[r->size_-1] == r->size_ );
+		if (!head_tag(b + n)) { //free block after...
+			free_node* r = get_free_node(b + n);
+			assert(foot_tag(b + n, r->size_) == r->size_);
+
+			//its free node ends up in the middle of the merged block, even when it straddles clean_
+			clean_ = std::max(clean_, msize(user_area(b + n) - b_) + NODE_WORDS);
+
 			n += r->size_;
-			remove_node(buckets_[log2(r->size_)], r);
+			remove_node(b_, buckets_[log2(r->size_)], r);
+		}
+	}
+
+	insert_node(buckets_[log2(n)], make_free_node(b, n));
+}
+
+free_node* heap_chunk::find_fit(msize nw, free_node**& head)
+{
+	if (fit_ == fit_policy::best_fit)
+		return find_best_node(b_, buckets_, nw, head);
+	return find_node(b_, buckets_, nw, head);
+}
+
+void heap_chunk::insert_node(free_node*& head, free_node* n)
+{
+	if (fit_ == fit_policy::address_ordered)
+		add_node_ordered(b_, head, n);
+	else
+		add_node(b_, head, n);
+}
+
+void heap_chunk::set_fit_policy(fit_policy p)
+{
+	if (p == fit_policy::address_ordered && fit_ != p) { //put the lists in order
+		std::vector<free_node*> ns;
+		for (auto& head: buckets_) {
+			ns.clear();
+			for (free_node* v = head; v; v = node_at(b_, v->next_)) {
+				ns.push_back(v);
+			}
+			std::sort(ns.begin(), ns.end());
+
+			head = nullptr;
+			for (auto v = ns.rbegin(); v != ns.rend(); ++v) {
+				(*v)->prev_ = 0;
+				(*v)->next_ = 0;
+				add_node(b_, head, *v);
+			}
 		}
 	}
+	fit_ = p;
+}
+
+msize heap_chunk::usable_size(void* p) const
+{
+	msize* b = block_of(p);
+	assert(b >= b_ && b < b_ + size_);
 
-	add_node(buckets_[log2(n)], make_free_node(b, n));
+	msize n = head_tag(b);
+	assert(n && !foot_tag(b, n));
+	return n * sizeof(msize) - BLOCK_OVERHEAD_BYTES;
 }
 
 msize heap_chunk::get_free_space() const
 {
-	msize r = 0;
+	msize r = quick_space_ * sizeof(msize);
 	for (auto v: buckets_) {
-		for (; v; v = v->next_) {
+		for (; v; v = node_at(b_, v->next_)) {
 			r += (v->size_ * sizeof(msize));
 		}
 	}
@@ -275,3 +699,13 @@ msize heap_chunk::get_min_alloc_size()
 	return MIN_BLOCK_SIZE_BYTES;
 }
 
+msize heap_chunk::get_block_overhead()
+{
+	return BLOCK_OVERHEAD_BYTES;
+}
+
+msize heap_chunk::get_max_size()
+{
+	return (std::min(MAX_BLOCK_SIZE, std::numeric_limits<msize>::max()/sizeof(msize)) - 3) * sizeof(msize);
+}
+
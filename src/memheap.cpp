@@ -4,46 +4,285 @@
 #include <new>
 #include <limits>
 #include <assert.h>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace memheap;
 
 namespace 
 {
 	const msize CHUNK_NUMBER = 8; //starting number of heap chunks
+	const msize ADAPTIVE_MAX_CHUNK = 64*1024*1024;
+	const msize ADAPTIVE_BLOCKS_PER_CHUNK = 64; //at least that many typical live blocks in a new chunk
 
+	const msize SMALL_MAX = 256; //biggest small block
+	const msize SMALL_SLAB = 16*1024; //bytes
+	const msize SMALL_CHUNK_SLABS = 16; //slabs in a small block chunk
+	const unsigned SMALL_CHUNK_SHIFT = 8; //chunk user data bits for the lifetime class
+
+	//file backed heap layout, the header page is followed by chunk regions,
+	//each region is a page with region_header and the chunk buffer
+	const msize FILE_PAGE = 4096;
+	const msize FILE_VERSION = 1;
+	const msize FILE_CAPACITY = msize(64)*1024*1024*1024;
+	const char FILE_MAGIC[8] = {'m', 'e', 'm', 'h', 'e', 'a', 'p', 0};
+
+	struct file_header
+	{
+		char magic_[8];
+		msize version_;
+		msize block_overhead_; //tag format the file has been written with
+		msize clean_; //closed cleanly, the chunk states can be trusted
+		msize root_; //offset from the file start, 0 - none
+		msize end_; //of the last region
+		msize chunk_size_;
+		msize blocks_[LIFETIME_CLASSES]; //live blocks by lifetime class
+	};
+
+	struct region_header
+	{
+		msize size_; //in bytes with this page
+		heap_chunk::saved_state st_;
+	};
+
+	static_assert(sizeof(file_header) <= FILE_PAGE && sizeof(region_header) <= FILE_PAGE, "file page");
+
+	//n mustn't be 0
+	inline msize log2(msize n)
+	{
+		assert(n);
+		return sizeof(unsigned long)*8 - 1 - __builtin_clzl(n);
+	}
+
+	//small block class is its size in msize
+	inline msize small_class(msize n)
+	{
+		return (n + sizeof(msize) - 1) / sizeof(msize);
+	}
+
+	//chunk user data is the lifetime class, small block chunks have their number (from 1) above it
+	inline unsigned lifetime_of(const heap_chunk* c)
+	{
+		return c->get_user_data() & ((1 << SMALL_CHUNK_SHIFT) - 1);
+	}
+
+	inline msize small_chunk_of(const heap_chunk* c)
+	{
+		return c->get_user_data() >> SMALL_CHUNK_SHIFT;
+	}
+
+	typedef std::chrono::steady_clock latency_clock;
+
+	inline std::uint64_t elapsed_ns(latency_clock::time_point t)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(latency_clock::now() - t).count();
+	}
+
+	//op and wait are only given with MEMHEAP_LATENCY_STATS, 
+	//both are recorded while the lock is still held
 	struct scoped_lock
 	{
-		scoped_lock(std::mutex*m)
+		scoped_lock(std::mutex*m, latency_histogram* op = nullptr, latency_histogram* wait = nullptr)
 			:m_(m)
+			,op_(op)
+			,owns_(true)
 		{
+			if (op_)
+				start_ = latency_clock::now();
 			if (m_)
 				m_->lock();
+			if (wait)
+				wait->record(elapsed_ns(start_));
+		}
+
+		//doesn't wait, see owns_lock()
+		scoped_lock(std::mutex*m, std::try_to_lock_t, latency_histogram* op = nullptr)
+			:m_(m)
+			,op_(op)
+			,owns_(true)
+		{
+			if (op_)
+				start_ = latency_clock::now();
+			if (m_ && !m_->try_lock()) {
+				m_ = nullptr;
+				op_ = nullptr;
+				owns_ = false;
+			}
 		}
+
+		bool owns_lock() const
+		{
+			return owns_;
+		}
+
 		~scoped_lock()
 		{
+			if (op_)
+				op_->record(elapsed_ns(start_));
 			if (m_)
 				m_->unlock();
 		}
 
 	private:
 		std::mutex* m_;
+		latency_histogram* op_;
+		bool owns_;
+		latency_clock::time_point start_;
 
 		scoped_lock(const scoped_lock&) = delete;
 		scoped_lock& operator=(const scoped_lock&) = delete;
 	};
+
+#ifdef MEMHEAP_LATENCY_STATS
+#define MEMHEAP_TIMED(op) &lat_->op, &lat_->lock_wait_
+#define MEMHEAP_TIMED_TRY(op) &lat_->op
+#else
+#define MEMHEAP_TIMED(op) nullptr, nullptr
+#define MEMHEAP_TIMED_TRY(op) nullptr
+#endif
 }
 
-heap::heap(bool thread_safe, msize est_max_size, msize est_cnt)
-	:cur_heap_(nullptr)
+struct heap::provisioner
+{
+	std::mutex mtx_;
+	std::condition_variable cv_;
+	std::vector<heap_chunk*> spares_;
+	std::atomic<msize> cnt_; //spares_.size() that can be read without the lock
+	msize watermark_;
+	msize size_; //of new spares
+	bool wanted_;
+	bool stop_;
+	std::thread thread_;
+};
+
+struct heap::backing_file
+{
+	int fd_;
+	char* base_; //the file is mapped at once, and grows under the mapping
+	msize capacity_;
+	bool recovered_;
+
+	backing_file()
+		:fd_(-1)
+		,base_(nullptr)
+		,capacity_(0)
+		,recovered_(false)
+	{}
+
+	~backing_file()
+	{
+		if (base_)
+			::munmap(base_, capacity_);
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	file_header* header()
+	{
+		return reinterpret_cast<file_header*>(base_);
+	}
+
+	region_header* region(heap_chunk* c)
+	{
+		return reinterpret_cast<region_header*>(static_cast<char*>(c->get_range().start_) - FILE_PAGE);
+	}
+};
+
+//the callbacks to run once the lock is released, declared before the lock
+struct heap::pressure_event
+{
+	pressure level_;
+	msize used_;
+	std::unique_ptr<std::vector<pressure_callback>> cbs_; //only when the level has changed
+
+	~pressure_event()
+	{
+		if (!cbs_)
+			return;
+		for (auto& v: *cbs_) {
+			v(level_, used_);
+		}
+	}
+};
+
+//header-less blocks of one class are cut from slabs, the slabs are plain blocks of chunks
+//that hold nothing else, so a chunk lookup tells a small block apart
+struct heap::small_blocks
+{
+	struct size_class
+	{
+		void* free_; //linked through their first word
+		char* cur_; //untouched rest of the last slab
+		char* end_;
+	};
+
+	struct small_chunk
+	{
+		heap_chunk* c_;
+		char* base_; //first slab
+		msize stride_; //from one slab to the next
+		std::vector<unsigned char> cls_; //by slab
+	};
+
+	msize max_; //bytes
+	std::vector<size_class> classes_[LIFETIME_CLASSES];
+	std::vector<small_chunk> chunks_;
+	msize cur_[LIFETIME_CLASSES]; //small chunk number new slabs are cut from, 0 - none
+
+	msize get_class(const heap_chunk* c, void* p) const
+	{
+		const small_chunk& sc = chunks_[small_chunk_of(c) - 1];
+		return sc.cls_[(static_cast<char*>(p) - sc.base_) / sc.stride_];
+	}
+};
+
+struct heap::latency_data
+{
+	latency_histogram allocate_;
+	latency_histogram free_;
+	latency_histogram lock_wait_;
+	latency_histogram growth_;
+};
+
+heap::heap(bool thread_safe, msize est_max_size, msize est_cnt, const heap_options& opt)
+	:opt_(opt)
+	 ,cur_heap_(nullptr)
 	 ,mtx_(nullptr)
+	 ,used_(0)
+	 ,total_(0)
+	 ,prov_(nullptr)
+	 ,lat_(nullptr)
+	 ,pending_(nullptr)
+	 ,file_(nullptr)
+	 ,callback_id_(0)
+	 ,level_(pressure::normal)
+	 ,small_(nullptr)
 {
+	for (auto& a: arenas_) {
+		a.cur_ = nullptr;
+		a.used_ = 0;
+		a.total_ = 0;
+		a.blocks_ = 0;
+	}
+
+#ifdef MEMHEAP_LATENCY_STATS
+	lat_ = new latency_data;
+#endif
+
 	assert(est_max_size && est_cnt);
 
 	if (est_max_size < heap_chunk::get_min_alloc_size()) {
 		est_max_size = heap_chunk::get_min_alloc_size();
 	}
 	else {
-		est_max_size += 2*sizeof(msize);
+		est_max_size += heap_chunk::get_block_overhead();
 	}
 
 	msize chunkcnt = est_cnt < CHUNK_NUMBER? est_cnt: CHUNK_NUMBER;
@@ -62,21 +301,89 @@ heap::heap(bool thread_safe, msize est_max_size, msize est_cnt)
 	if (chunk_size_ < est_max_size)
 		chunk_size_ = est_max_size;
 
-	for (msize i = 0; i != chunkcnt; ++i) {
-		heap_chunk* ph = new heap_chunk(chunk_size_);
-		if (i == 0) 
-			cur_heap_ = ph;
-		hs_.push_back(ph);
+	if (opt_.budget && chunk_size_ * chunkcnt > opt_.budget) { //grow within the budget
+		if (opt_.budget < get_chunk_slack() + heap_chunk::get_min_alloc_size()) {
+			delete lat_;
+			throw std::invalid_argument("memheap: budget is too small for a chunk");
+		}
+		chunkcnt = 1;
+		chunk_size_ = std::min(std::max(opt_.budget / CHUNK_NUMBER, est_max_size), opt_.budget - get_chunk_slack());
 	}
-	std::sort(hs_.begin(), hs_.end(), [](const chunks::value_type& v1, const chunks::value_type& v2) -> bool { return v1->get_range().end_ < v2->get_range().end_; } );
+
+	if (opt_.adaptive_chunks) { //start small, and let the chunks grow
+		live_sizes_.resize(sizeof(msize)*8, 0);
+		chunkcnt = 1;
+		chunk_size_ = std::min(chunk_size_, get_max_chunk_size());
+	}
+
+	//the other classes get chunks on their first allocation
+	if (!opt_.file_path.empty()) {
+		try {
+			open_file(chunkcnt);
+		}
+		catch (...) {
+			for (auto v: hs_) {
+				delete v;
+			}
+			delete file_;
+			delete lat_;
+			throw;
+		}
+	}
+	else {
+		for (msize i = 0; i != chunkcnt; ++i) {
+			add_chunk(make_chunk(chunk_size_), lifetime::normal);
+		}
+	}
+	cur_heap_ = arenas_[0].cur_;
 
 	if (thread_safe) {
 		mtx_ = new std::mutex;
 	}
+
+	if (opt_.small_block_size && !file_) {
+		small_ = new small_blocks;
+		small_->max_ = small_class(std::min(opt_.small_block_size, SMALL_MAX)) * sizeof(msize);
+		small_blocks::size_class sc = {nullptr, nullptr, nullptr};
+		for (unsigned i = 0; i != LIFETIME_CLASSES; ++i) {
+			small_->classes_[i].resize(small_class(small_->max_) + 1, sc);
+			small_->cur_[i] = 0;
+		}
+	}
+
+	if (opt_.spare_chunks && !file_ && !opt_.budget) {
+		prov_ = new provisioner;
+		prov_->cnt_ = 0;
+		prov_->watermark_ = opt_.spare_watermark? opt_.spare_watermark: chunk_size_;
+		prov_->size_ = chunk_size_;
+		prov_->wanted_ = false;
+		prov_->stop_ = false;
+		prov_->thread_ = std::thread(&heap::provision, this);
+	}
 }
 
 heap::~heap()
 {
+	if (prov_) {
+		{
+			std::lock_guard<std::mutex> lk(prov_->mtx_);
+			prov_->stop_ = true;
+		}
+		prov_->cv_.notify_one();
+		prov_->thread_.join();
+
+		for (auto v: prov_->spares_) {
+			delete v;
+		}
+		delete prov_;
+	}
+
+	delete lat_;
+	delete small_;
+
+	if (file_)
+		close_file();
+
 	if (mtx_) {
 		delete mtx_;
 	}
@@ -86,45 +393,291 @@ heap::~heap()
 	}
 }
 
-void* heap::do_allocate(msize n)
+void heap::open_file(msize chunkcnt)
 {
-	void *pr = cur_heap_->allocate(n);
+	file_ = new backing_file;
+	file_->capacity_ = opt_.file_capacity? opt_.file_capacity: FILE_CAPACITY;
+
+	file_->fd_ = ::open(opt_.file_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (file_->fd_ < 0)
+		throw std::runtime_error("memheap: can't open " + opt_.file_path);
+
+	struct stat fs;
+	if (::fstat(file_->fd_, &fs) < 0)
+		throw std::runtime_error("memheap: can't stat " + opt_.file_path);
+	msize fsize = fs.st_size;
+	if (fsize > file_->capacity_)
+		throw std::runtime_error("memheap: " + opt_.file_path + " is bigger than file_capacity");
+
+	void* m = ::mmap(nullptr, file_->capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, file_->fd_, 0);
+	if (m == MAP_FAILED)
+		throw std::bad_alloc();
+	file_->base_ = static_cast<char*>(m);
+
+	file_header* h = file_->header();
+
+	if (!fsize) { //new one
+		if (::ftruncate(file_->fd_, FILE_PAGE) < 0)
+			throw std::bad_alloc();
+		std::memcpy(h->magic_, FILE_MAGIC, sizeof(FILE_MAGIC));
+		h->version_ = FILE_VERSION;
+		h->block_overhead_ = heap_chunk::get_block_overhead();
+		h->end_ = FILE_PAGE;
+		h->chunk_size_ = chunk_size_;
+
+		for (msize i = 0; i != chunkcnt; ++i) {
+			add_chunk(map_chunk(chunk_size_, lifetime::normal), lifetime::normal);
+		}
+	}
+	else {
+		if (fsize < FILE_PAGE || std::memcmp(h->magic_, FILE_MAGIC, sizeof(FILE_MAGIC)) 
+				|| h->version_ != FILE_VERSION || h->block_overhead_ != heap_chunk::get_block_overhead()
+				|| h->end_ < FILE_PAGE || h->end_ > fsize)
+			throw std::runtime_error("memheap: " + opt_.file_path + " isn't a compatible heap file");
+
+		//a region that has been added but not registered in the header
+		if (fsize > h->end_ && ::ftruncate(file_->fd_, h->end_) < 0)
+			throw std::runtime_error("memheap: can't truncate " + opt_.file_path);
+
+		file_->recovered_ = !h->clean_;
+		chunk_size_ = h->chunk_size_;
+
+		for (msize off = FILE_PAGE; off != h->end_;) {
+			region_header* r = reinterpret_cast<region_header*>(file_->base_ + off);
+			if (r->size_ <= FILE_PAGE || r->size_ > h->end_ - off || r->st_.user_data_ >= LIFETIME_CLASSES)
+				throw std::runtime_error("memheap: " + opt_.file_path + " is corrupted");
+
+			std::unique_ptr<heap_chunk> c(new heap_chunk(file_->base_ + off + FILE_PAGE, r->size_ - FILE_PAGE, r->st_));
+			if (file_->recovered_) { //the saved state is stale, go by the boundary tags
+				msize busy = 0;
+				if (!c->check(&busy))
+					throw std::runtime_error("memheap: " + opt_.file_path + " is corrupted");
+				c->rebuild();
+				arenas_[lifetime_of(c.get())].blocks_ += busy;
+			}
+			if (opt_.quick_list_budget)
+				c->set_quick_budget(opt_.quick_list_budget);
+			c->set_fit_policy(opt_.fit);
+
+			arena& a = arenas_[lifetime_of(c.get())];
+			a.used_ += c->get_allocated_space();
+			used_ += c->get_allocated_space();
+
+			add_chunk(c.get(), static_cast<lifetime>(c->get_user_data()));
+			c.release();
+			off += r->size_;
+		}
+
+		if (!file_->recovered_) {
+			for (unsigned i = 0; i != LIFETIME_CLASSES; ++i) {
+				arenas_[i].blocks_ = h->blocks_[i];
+			}
+		}
+		if (!arenas_[0].cur_) //every heap starts with normal chunks
+			throw std::runtime_error("memheap: " + opt_.file_path + " is corrupted");
+	}
+
+	//dirty until closed
+	h->clean_ = 0;
+	::msync(file_->base_, FILE_PAGE, MS_SYNC);
+}
+
+void heap::close_file()
+{
+	drain_frees();
+
+	file_header* h = file_->header();
+	for (auto v: hs_) {
+		v->save(file_->region(v)->st_);
+	}
+	for (unsigned i = 0; i != LIFETIME_CLASSES; ++i) {
+		h->blocks_[i] = arenas_[i].blocks_;
+	}
+	h->chunk_size_ = chunk_size_;
+
+	::msync(file_->base_, h->end_, MS_SYNC);
+	h->clean_ = 1;
+	::msync(file_->base_, FILE_PAGE, MS_SYNC);
+
+	delete file_;
+	file_ = nullptr;
+}
+
+heap_chunk* heap::map_chunk(msize n, lifetime l)
+{
+	file_header* h = file_->header();
+
+	//same slack as heap_chunk(n)
+	msize bytes = (n + 3*sizeof(msize) + FILE_PAGE - 1) / FILE_PAGE * FILE_PAGE;
+	msize off = h->end_;
+	if (file_->capacity_ - off < bytes + FILE_PAGE)
+		throw std::bad_alloc();
+
+	if (::ftruncate(file_->fd_, off + FILE_PAGE + bytes) < 0)
+		throw std::bad_alloc();
+
+	std::unique_ptr<heap_chunk> c(new heap_chunk(file_->base_ + off + FILE_PAGE, bytes));
+	if (opt_.quick_list_budget)
+		c->set_quick_budget(opt_.quick_list_budget);
+	c->set_fit_policy(opt_.fit);
+
+	region_header* r = reinterpret_cast<region_header*>(file_->base_ + off);
+	r->size_ = FILE_PAGE + bytes;
+	r->st_.user_data_ = static_cast<unsigned>(l);
+	h->end_ = off + r->size_;
+	return c.release();
+}
+
+void* heap::do_allocate(msize n, bool zeroed, lifetime l)
+{
+	void* pr = do_try_allocate(n, zeroed, l);
+	if (!pr)
+		throw std::bad_alloc();
+	return pr;
+}
+
+void* heap::do_try_allocate(msize n, bool zeroed, lifetime l)
+{
+	drain_frees();
+
+	if (small_ && n <= small_->max_) {
+		void* p = small_allocate(n, zeroed, l);
+		if (p)
+			return p;
+		//no room for a slab, but a plain block may still fit
+	}
+	return block_allocate(n, zeroed, l);
+}
+
+void* heap::small_allocate(msize n, bool zeroed, lifetime l)
+{
+	msize cls = small_class(n);
+	msize bytes = cls * sizeof(msize);
+	small_blocks::size_class& sc = small_->classes_[static_cast<unsigned>(l)][cls];
+
+	void* p = sc.free_;
+	if (p) {
+		sc.free_ = *static_cast<void**>(p);
+	}
+	else {
+		if (sc.cur_ == sc.end_) {
+			char* s = new_slab(l, cls);
+			if (!s)
+				return nullptr;
+			sc.cur_ = s;
+			sc.end_ = s + SMALL_SLAB / bytes * bytes;
+		}
+		p = sc.cur_;
+		sc.cur_ += bytes;
+	}
+	++arenas_[static_cast<unsigned>(l)].blocks_;
+
+	if (zeroed)
+		std::memset(p, 0, bytes);
+	return p;
+}
+
+char* heap::new_slab(lifetime l, msize cls)
+{
+	unsigned li = static_cast<unsigned>(l);
+	msize i = small_->cur_[li];
+	heap_chunk* c = i? small_->chunks_[i-1].c_: nullptr;
+	char* s = c? static_cast<char*>(chunk_allocate(c, SMALL_SLAB, false)): nullptr;
+
+	if (!s) { //new small block chunk
+		msize sz = SMALL_CHUNK_SLABS * (SMALL_SLAB + heap_chunk::get_block_overhead());
+		if (opt_.budget && total_ + sz + get_chunk_slack() > opt_.budget)
+			return nullptr;
+
+		small_->chunks_.reserve(small_->chunks_.size() + 1);
+		std::unique_ptr<heap_chunk> nc(make_chunk(sz));
+		heap_chunk* cur = arenas_[li].cur_;
+		add_chunk(nc.get(), l);
+		arenas_[li].cur_ = cur; //never allocate plain blocks from it
+		c = nc.release();
+
+		c->set_user_data(li | (small_->chunks_.size() + 1) << SMALL_CHUNK_SHIFT);
+		small_blocks::small_chunk sc = {c, nullptr, 0, {}};
+		small_->chunks_.push_back(sc);
+		small_->cur_[li] = small_->chunks_.size();
+
+		s = static_cast<char*>(chunk_allocate(c, SMALL_SLAB, false));
+		assert(s);
+	}
+	--arenas_[li].blocks_; //the small blocks are counted instead
+
+	//a small block chunk is only cut into slabs one after another, they are never freed
+	small_blocks::small_chunk& sc = small_->chunks_[small_chunk_of(c) - 1];
+	if (!sc.base_) {
+		sc.base_ = s;
+		sc.stride_ = c->usable_size(s) + heap_chunk::get_block_overhead();
+	}
+	assert((s - sc.base_) % sc.stride_ == 0);
+	sc.cls_.push_back(static_cast<unsigned char>(cls));
+	assert(sc.cls_.size() == msize(s - sc.base_) / sc.stride_ + 1);
+	return s;
+}
+
+void* heap::block_allocate(msize n, bool zeroed, lifetime l)
+{
+	arena& a = arenas_[static_cast<unsigned>(l)];
+	assert(!a.cur_ || !small_chunk_of(a.cur_));
+
+	void *pr = a.cur_? chunk_allocate(a.cur_, n, zeroed): nullptr;
+	if (prov_ && total_ - used_ < prov_->watermark_)
+		request_spare();
+
 	if (!pr) {
-		for (auto v: hs_) { //look for any chunk that works
-			if (v == cur_heap_)
+		for (auto v: a.hs_) { //look for any chunk of the class that works
+			if (v == a.cur_ || small_chunk_of(v))
 				continue;
-			pr = v->allocate(n);
+			pr = chunk_allocate(v, n, zeroed);
 			if (pr) {
+				a.cur_ = v;
 				cur_heap_ = v;
 				return pr;
 			}
 		}
+#ifdef MEMHEAP_LATENCY_STATS
+		latency_clock::time_point gt = latency_clock::now();
+#endif
+		if (opt_.adaptive_chunks)
+			adapt_chunk_size();
+
 		//create a new heap
-		if (n < chunk_size_) {
-			cur_heap_ = new heap_chunk(chunk_size_);
+		msize sz = n < chunk_size_? chunk_size_: std::min(n * 2, heap_chunk::get_max_size());
+		if (opt_.budget) { //whatever is left of it
+			msize slack = get_chunk_slack();
+			msize left = opt_.budget > total_ + slack? opt_.budget - total_ - slack: 0;
+			if (left < n + heap_chunk::get_min_alloc_size())
+				return nullptr;
+			sz = std::min(sz, left);
+		}
+
+		heap_chunk* c;
+		if (file_) {
+			c = map_chunk(sz, l);
+		}
+		else if (n < chunk_size_ && !opt_.budget) {
+			c = take_spare(n);
+			if (!c)
+				c = make_chunk(sz);
 		}
 		else { //big size
-			cur_heap_ = new heap_chunk(n * 2);
+			c = make_chunk(sz);
 			
 		}
-		hs_.push_back(cur_heap_);
-
-		// keep chunks sorted
-		std::sort(hs_.begin(), hs_.end(), [](const chunks::value_type& v1, const chunks::value_type& v2) -> bool { return v1->get_range().end_ < v2->get_range().end_; } );
-		
-		/* just sorting seems to be faster than inserting in sorted order
-		hs_.insert( std::upper_bound(hs_.begin(), hs_.end(), cur_heap_, 
-					[](const chunks::value_type& v1, const chunks::value_type& v2) -> bool { return v1->get_range().end_ < v2->get_range().end_; }
-					)
-					,cur_heap_
-					);
-					*/
+		add_chunk(c, l);
+#ifdef MEMHEAP_LATENCY_STATS
+		lat_->growth_.record(elapsed_ns(gt));
+#endif
 
-		pr = cur_heap_->allocate(n);
+		pr = chunk_allocate(a.cur_, n, zeroed);
 		if (!pr) {
 			throw std::bad_alloc();
 		}
 	}
+	cur_heap_ = a.cur_;
 	return pr;
 }
 
@@ -133,32 +686,354 @@ void* heap::allocate(msize n)
 	if (!n)
 		return nullptr;
 
-	scoped_lock lk{mtx_};
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(allocate_)};
 
-	return do_allocate(n);
+	void* p = do_allocate(n);
+	check_pressure(ev);
+	return p;
+}
+
+void* heap::allocate(msize n, lifetime hint)
+{
+	if (!n)
+		return nullptr;
+
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(allocate_)};
+
+	void* p = do_allocate(n, false, hint);
+	check_pressure(ev);
+	return p;
+}
+
+void* heap::try_allocate(msize n)
+{
+	if (!n)
+		return nullptr;
+
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(allocate_)};
+
+	void* p = nullptr;
+	try { //only the system can fail it now
+		p = do_try_allocate(n, false, lifetime::normal);
+	}
+	catch (const std::bad_alloc&) {
+	}
+	check_pressure(ev);
+	return p;
+}
+
+heap::allocation_result heap::allocate_at_least(msize n)
+{
+	allocation_result r = {nullptr, 0};
+	if (!n)
+		return r;
+
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(allocate_)};
+
+	r.ptr_ = do_allocate(n);
+	if (small_ && n <= small_->max_)
+		r.size_ = usable_size_locked(r.ptr_); //a plain block when there was no room for a slab
+	else
+		r.size_ = cur_heap_->usable_size(r.ptr_); //do_allocate() leaves the chunk current
+	check_pressure(ev);
+	return r;
+}
+
+void* heap::allocate_zeroed(msize n)
+{
+	if (!n)
+		return nullptr;
+
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(allocate_)};
+
+	void* p = do_allocate(n, true);
+	check_pressure(ev);
+	return p;
 }
 
 void heap::free(void* p)
+{
+	free(p, 0);
+}
+
+void heap::free(void* p, msize n)
 {
 	if (!p)
 		return;
 
-	scoped_lock lk{mtx_};
+	pressure_event ev;
+
+	if (mtx_ && opt_.deferred_free) {
+		scoped_lock lk{mtx_, std::try_to_lock, MEMHEAP_TIMED_TRY(free_)};
+		if (!lk.owns_lock()) { //leave it to the lock owner
+			void* head = pending_.load(std::memory_order_relaxed);
+			do {
+				*static_cast<void**>(p) = head;
+			} while (!pending_.compare_exchange_weak(head, p, std::memory_order_release, std::memory_order_relaxed));
+			return;
+		}
+		drain_frees();
+		do_free(p, n);
+		check_pressure(ev);
+		return;
+	}
+
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(free_)};
+	do_free(p, n);
+	check_pressure(ev);
+}
+
+void heap::free_batch(void* const* p, msize cnt)
+{
+	free_batch(p, nullptr, cnt);
+}
 
+void heap::free_batch(void* const* p, const msize* n, msize cnt)
+{
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(free_)};
+
+	drain_frees();
+	for (msize i = 0; i != cnt; ++i) {
+		if (p[i])
+			do_free(p[i], n? n[i]: 0);
+	}
+	check_pressure(ev);
+}
+
+void heap::do_free(void* p, msize n)
+{
 	assert(cur_heap_);
 
 	//find chunk
 	heap_chunk::range r = cur_heap_->get_range();
-	if (r.start_ <= p && r.end_ > p) {
-		cur_heap_->free(p);
+	if (r.start_ > p || r.end_ <= p) {
+		cur_heap_ = find_chunk(p);
+		if (!small_chunk_of(cur_heap_))
+			arenas_[lifetime_of(cur_heap_)].cur_ = cur_heap_;
+	}
+
+	if (small_chunk_of(cur_heap_)) { //the size saves a look at the slab class
+		unsigned li = lifetime_of(cur_heap_);
+		void*& head = small_->classes_[li][n && n <= small_->max_? small_class(n): small_->get_class(cur_heap_, p)].free_;
+		*static_cast<void**>(p) = head;
+		head = p;
+		--arenas_[li].blocks_;
 		return;
 	}
+	chunk_free(cur_heap_, p);
+}
 
+void heap::drain_frees()
+{
+	if (!pending_.load(std::memory_order_relaxed))
+		return;
 
-	assert(!hs_.empty());
+	void* p = pending_.exchange(nullptr, std::memory_order_acquire);
+	while (p) {
+		void* next = *static_cast<void**>(p);
+		do_free(p);
+		p = next;
+	}
+}
 
+void heap::flush_frees()
+{
+	pressure_event ev;
+	scoped_lock lk{mtx_};
+	drain_frees();
+	check_pressure(ev);
+}
+
+msize heap::usable_size(void* p) const
+{
+	if (!p)
+		return 0;
+
+	scoped_lock lk{mtx_};
+	return usable_size_locked(p);
+}
+
+msize heap::usable_size_locked(void* p) const
+{
+	heap_chunk::range r = cur_heap_->get_range();
+	heap_chunk* c = (r.start_ <= p && r.end_ > p)? cur_heap_: find_chunk(p);
+	if (small_chunk_of(c))
+		return small_->get_class(c, p) * sizeof(msize);
+	return c->usable_size(p);
+}
+
+void* heap::chunk_allocate(heap_chunk* c, msize n, bool zeroed)
+{
+	msize a = c->get_allocated_space();
+	void* p = zeroed? c->allocate_zeroed(n): c->allocate(n);
+	msize d = c->get_allocated_space() - a;
+	used_ += d;
+	if (d) {
+		arena& ar = arenas_[lifetime_of(c)];
+		ar.used_ += d;
+		++ar.blocks_;
+		if (!live_sizes_.empty())
+			++live_sizes_[log2(d)];
+	}
+	return p;
+}
+
+void heap::chunk_free(heap_chunk* c, void* p)
+{
+	msize a = c->get_allocated_space();
+	c->free(p);
+	msize d = a - c->get_allocated_space();
+	used_ -= d;
+	arena& ar = arenas_[lifetime_of(c)];
+	ar.used_ -= d;
+	--ar.blocks_;
+	assert(d); //a busy block is never empty
+	if (!live_sizes_.empty() && d && live_sizes_[log2(d)]) //blocks of a reopened file aren't counted
+		--live_sizes_[log2(d)];
+}
+
+msize heap::get_chunk_slack() const
+{
+	return opt_.file_path.empty()? 4*sizeof(msize): 2*FILE_PAGE;
+}
+
+msize heap::get_max_chunk_size() const
+{
+	return std::min(opt_.max_chunk_size? opt_.max_chunk_size: ADAPTIVE_MAX_CHUNK, heap_chunk::get_max_size());
+}
+
+void heap::adapt_chunk_size()
+{
+	//90% of the live blocks are under typical
+	msize cnt = 0;
+	for (auto v: live_sizes_) {
+		cnt += v;
+	}
+	msize typical = heap_chunk::get_min_alloc_size();
+	msize acc = 0;
+	for (msize i = 0; cnt && i != live_sizes_.size(); ++i) {
+		acc += live_sizes_[i];
+		if (acc * 10 >= cnt * 9) {
+			typical = std::max(typical, msize(2) << i);
+			break;
+		}
+	}
+
+	//double the chunks, but don't grow faster than the heap itself
+	msize sz = std::max(chunk_size_ * 2, typical * ADAPTIVE_BLOCKS_PER_CHUNK);
+	sz = std::min(sz, std::max(total_, typical * ADAPTIVE_BLOCKS_PER_CHUNK));
+	chunk_size_ = std::max(std::min(sz, get_max_chunk_size()), heap_chunk::get_min_alloc_size());
+}
+
+msize heap::get_total_size() const
+{
+	scoped_lock lk{mtx_};
+	return total_;
+}
+
+msize heap::get_chunk_count() const
+{
+	scoped_lock lk{mtx_};
+	return hs_.size();
+}
+
+void heap::provision()
+{
+	std::unique_lock<std::mutex> lk(prov_->mtx_);
+
+	while (!prov_->stop_) {
+		if (!prov_->wanted_ || prov_->spares_.size() >= opt_.spare_chunks) {
+			prov_->wanted_ = false;
+			prov_->cv_.wait(lk);
+			continue;
+		}
+
+		//build and prefault the chunk without holding anything
+		msize sz = prov_->size_;
+		lk.unlock();
+		heap_chunk* c = nullptr;
+		try {
+			c = make_chunk(sz);
+		}
+		catch (const std::bad_alloc&) {
+		}
+		lk.lock();
+
+		if (!c) { //let the allocating thread deal with it
+			prov_->wanted_ = false;
+			continue;
+		}
+		prov_->spares_.push_back(c);
+		prov_->cnt_ = prov_->spares_.size();
+	}
+}
+
+void heap::request_spare()
+{
+	if (prov_->cnt_ >= opt_.spare_chunks)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(prov_->mtx_);
+		prov_->wanted_ = true;
+	}
+	prov_->cv_.notify_one();
+}
+
+heap_chunk* heap::take_spare(msize n)
+{
+	if (!prov_)
+		return nullptr;
+
+	heap_chunk* c = nullptr;
+	std::vector<heap_chunk*> stale;
+	{
+		std::lock_guard<std::mutex> lk(prov_->mtx_);
+		prov_->size_ = chunk_size_;
+
+		//spares made before the chunk size grew would hold the heap back at the old size
+		while (!c && !prov_->spares_.empty()) {
+			heap_chunk* v = prov_->spares_.back();
+			prov_->spares_.pop_back();
+			if (v->get_total_size() >= chunk_size_ && v->get_free_space() >= n + heap_chunk::get_min_alloc_size())
+				c = v;
+			else
+				stale.push_back(v);
+		}
+		prov_->cnt_ = prov_->spares_.size();
+		prov_->wanted_ = true;
+	}
+	prov_->cv_.notify_one();
+
+	for (auto v: stale) {
+		delete v;
+	}
+	return c;
+}
+
+msize heap::get_spare_chunks() const
+{
+	return prov_? msize(prov_->cnt_): 0;
+}
+
+heap_chunk* heap::make_chunk(msize n) const
+{
+	std::unique_ptr<heap_chunk> c(new heap_chunk(n));
+	if (opt_.quick_list_budget)
+		c->set_quick_budget(opt_.quick_list_budget);
+	c->set_fit_policy(opt_.fit);
+	return c.release();
+}
+
+heap_chunk* heap::find_chunk(void* p) const
+{
+	assert(!hs_.empty());
 
-	//
 	auto it = std::upper_bound(hs_.begin(), hs_.end(), p, [](void* pb, const chunks::value_type& v)->bool 
 			{
 				heap_chunk::range hr = v->get_range();
@@ -169,24 +1044,178 @@ void heap::free(void* p)
 	assert(it != hs_.end());
 
 	assert((*it)->get_range().start_ <= p && (*it)->get_range().end_ > p);
-	cur_heap_ = (*it);
-	cur_heap_->free(p);
+	return *it;
+}
+
+void heap::add_chunk(heap_chunk* c, lifetime l)
+{
+	arena& a = arenas_[static_cast<unsigned>(l)];
+
+	c->set_user_data(static_cast<unsigned>(l));
+	a.hs_.push_back(c);
+	a.total_ += c->get_total_size();
+	a.cur_ = c;
+
+	hs_.push_back(c);
+	total_ += c->get_total_size();
+
+	// keep chunks sorted
+	std::sort(hs_.begin(), hs_.end(), [](const chunks::value_type& v1, const chunks::value_type& v2) -> bool { return v1->get_range().end_ < v2->get_range().end_; } );
 	
+	/* just sorting seems to be faster than inserting in sorted order
+	hs_.insert( std::upper_bound(hs_.begin(), hs_.end(), c, 
+				[](const chunks::value_type& v1, const chunks::value_type& v2) -> bool { return v1->get_range().end_ < v2->get_range().end_; }
+				)
+				,c
+				);
+				*/
+}
 
-	/*
-	for (auto v: hs_) {
-		if (cur_heap_ == v)
-			continue;
-		r = v->get_range();
-		if (r.start_ <= p && r.end_ > p) {
-			v->free(p);
-			cur_heap_ = v;
-			return;
+void heap::release_chunk(heap_chunk* c)
+{
+	assert(!c->get_allocated_space());
+	assert(hs_.size() > 1);
+
+	arena& a = arenas_[lifetime_of(c)];
+	a.hs_.erase(std::find(a.hs_.begin(), a.hs_.end(), c));
+	a.total_ -= c->get_total_size();
+	if (a.cur_ == c) { //any but a small block chunk
+		auto it = std::find_if(a.hs_.begin(), a.hs_.end(), [](heap_chunk* v) -> bool { return !small_chunk_of(v); });
+		a.cur_ = it == a.hs_.end()? nullptr: *it;
+	}
+
+	hs_.erase(std::find(hs_.begin(), hs_.end(), c));
+	total_ -= c->get_total_size();
+	if (cur_heap_ == c)
+		cur_heap_ = hs_.front();
+	delete c;
+}
+
+msize heap::do_trim()
+{
+	if (file_) //the file doesn't shrink
+		return 0;
+
+	msize r = 0;
+	for (msize i = 0; i < hs_.size() && hs_.size() > 1;) {
+		if (!hs_[i]->get_allocated_space()) {
+			r += hs_[i]->get_total_size();
+			release_chunk(hs_[i]);
 		}
+		else
+			++i;
 	}
+	return r;
+}
+
+msize heap::trim()
+{
+	pressure_event ev;
+	scoped_lock lk{mtx_};
+	drain_frees();
+	msize r = do_trim();
+	check_pressure(ev);
+	return r;
+}
+
+void heap::set_root(void* p)
+{
+	scoped_lock lk{mtx_};
 
-	assert(false);
-	*/
+	if (!file_)
+		return;
+	file_->header()->root_ = p? static_cast<char*>(p) - file_->base_: 0;
+}
+
+void* heap::get_root() const
+{
+	scoped_lock lk{mtx_};
+
+	if (!file_)
+		return nullptr;
+	msize r = file_->header()->root_;
+	return r? file_->base_ + r: nullptr;
+}
+
+bool heap::is_recovered() const
+{
+	return file_ && file_->recovered_;
+}
+
+bool heap::check() const
+{
+	scoped_lock lk{mtx_};
+
+	for (auto v: hs_) {
+		if (!v->check())
+			return false;
+	}
+	return true;
+}
+
+msize heap::add_pressure_callback(pressure_callback cb)
+{
+	scoped_lock lk{mtx_};
+
+	if (callbacks_.empty())
+		level_ = get_level();
+	callbacks_.push_back(std::make_pair(++callback_id_, cb));
+	return callback_id_;
+}
+
+void heap::remove_pressure_callback(msize id)
+{
+	scoped_lock lk{mtx_};
+
+	auto it = std::find_if(callbacks_.begin(), callbacks_.end(), [id](const std::pair<msize, pressure_callback>& v) { return v.first == id; });
+	if (it != callbacks_.end())
+		callbacks_.erase(it);
+}
+
+pressure heap::get_pressure() const
+{
+	scoped_lock lk{mtx_};
+	return get_level();
+}
+
+pressure heap::get_level() const
+{
+	if (opt_.hard_limit && used_ >= opt_.hard_limit)
+		return pressure::hard;
+	if (opt_.soft_limit && used_ >= opt_.soft_limit)
+		return pressure::soft;
+	return pressure::normal;
+}
+
+void heap::check_pressure(pressure_event& ev)
+{
+	if (callbacks_.empty())
+		return;
+
+	pressure l = get_level();
+	if (l == level_)
+		return;
+
+	level_ = l;
+	ev.level_ = l;
+	ev.used_ = used_;
+	ev.cbs_.reset(new std::vector<pressure_callback>);
+	for (auto& v: callbacks_) {
+		ev.cbs_->push_back(v.second);
+	}
+}
+
+heap::lifetime_stats heap::get_lifetime_stats(lifetime l) const
+{
+	scoped_lock lk{mtx_};
+
+	const arena& a = arenas_[static_cast<unsigned>(l)];
+	lifetime_stats r;
+	r.allocated_ = a.used_;
+	r.blocks_ = a.blocks_;
+	r.total_size_ = a.total_;
+	r.chunk_count_ = a.hs_.size();
+	return r;
 }
 
 msize heap::get_free_space() const
@@ -200,3 +1229,182 @@ msize heap::get_free_space() const
 	return r;
 }
 
+
+heap::latency_report heap::get_latency() const
+{
+	scoped_lock lk{mtx_};
+
+	latency_report r = {};
+	if (lat_) {
+		r.allocate_ = lat_->allocate_.get_percentiles();
+		r.free_ = lat_->free_.get_percentiles();
+		r.lock_wait_ = lat_->lock_wait_.get_percentiles();
+		r.growth_ = lat_->growth_.get_percentiles();
+	}
+	return r;
+}
+
+void heap::reset_latency()
+{
+	scoped_lock lk{mtx_};
+
+	if (lat_) {
+		lat_->allocate_.reset();
+		lat_->free_.reset();
+		lat_->lock_wait_.reset();
+		lat_->growth_.reset();
+	}
+}
+
+heap::handle heap::allocate_handle(msize n)
+{
+	if (!n)
+		return 0;
+
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(allocate_)};
+
+	drain_frees();
+
+	handle_entry e;
+	e.p_ = block_allocate(n, false, lifetime::normal); //not a small block, compact() moves it
+	if (!e.p_)
+		throw std::bad_alloc();
+	e.size_ = n;
+	e.pins_ = 0;
+	check_pressure(ev);
+
+	if (!free_handles_.empty()) {
+		handle h = free_handles_.back();
+		free_handles_.pop_back();
+		handles_[h-1] = e;
+		return h;
+	}
+	handles_.push_back(e);
+	return handles_.size();
+}
+
+void heap::free_handle(handle h)
+{
+	if (!h)
+		return;
+
+	pressure_event ev;
+	scoped_lock lk{mtx_, MEMHEAP_TIMED(free_)};
+
+	assert(h <= handles_.size());
+	handle_entry& e = handles_[h-1];
+	assert(e.p_ && !e.pins_);
+
+	cur_heap_ = find_chunk(e.p_);
+	arenas_[lifetime_of(cur_heap_)].cur_ = cur_heap_;
+	chunk_free(cur_heap_, e.p_);
+	check_pressure(ev);
+
+	e.p_ = nullptr;
+	free_handles_.push_back(h);
+}
+
+void* heap::pin(handle h)
+{
+	if (!h)
+		return nullptr;
+
+	scoped_lock lk{mtx_};
+
+	assert(h <= handles_.size() && handles_[h-1].p_);
+	handle_entry& e = handles_[h-1];
+	++e.pins_;
+	return e.p_;
+}
+
+void heap::unpin(handle h)
+{
+	if (!h)
+		return;
+
+	scoped_lock lk{mtx_};
+
+	assert(h <= handles_.size() && handles_[h-1].pins_);
+	--handles_[h-1].pins_;
+}
+
+void* heap::deref(handle h) const
+{
+	if (!h)
+		return nullptr;
+
+	scoped_lock lk{mtx_};
+
+	assert(h <= handles_.size());
+	return handles_[h-1].p_;
+}
+
+msize heap::compact(msize max_bytes)
+{
+	pressure_event ev;
+	scoped_lock lk{mtx_};
+	drain_frees();
+
+	//drop the chunks that are already empty
+	do_trim();
+
+	//movable blocks per chunk
+	std::vector<std::vector<handle_entry*>> movable(hs_.size());
+	for (auto& e: handles_) {
+		if (!e.p_ || e.pins_)
+			continue;
+		heap_chunk* c = find_chunk(e.p_);
+		movable[std::find(hs_.begin(), hs_.end(), c) - hs_.begin()].push_back(&e);
+	}
+
+	//sparse chunks first
+	std::vector<heap_chunk*> order(hs_);
+	std::sort(order.begin(), order.end(), [](heap_chunk* v1, heap_chunk* v2) -> bool { return v1->get_allocated_space() < v2->get_allocated_space(); } );
+
+	msize moved = 0;
+	std::vector<heap_chunk*> empty;
+
+	for (auto src: order) {
+		if (moved >= max_bytes)
+			break;
+
+		//only pack into the chunks that are denser than the source
+		msize srcfill = src->get_allocated_space();
+		if (srcfill * 2 > src->get_total_size())
+			break; //not sparse
+
+		std::vector<handle_entry*>& mv = movable[std::find(hs_.begin(), hs_.end(), src) - hs_.begin()];
+		for (auto e: mv) {
+			if (moved >= max_bytes)
+				break;
+
+			void* np = nullptr;
+			for (auto dst = order.rbegin(); !np && *dst != src; ++dst) {
+				if ((*dst)->get_allocated_space() <= srcfill)
+					break;
+				if (lifetime_of(*dst) != lifetime_of(src) || small_chunk_of(*dst))
+					continue; //keep the lifetime classes apart, and the small blocks
+				np = chunk_allocate(*dst, e->size_, false);
+			}
+			if (!np)
+				break; //nowhere to move
+
+			std::memcpy(np, e->p_, e->size_);
+			chunk_free(src, e->p_);
+			e->p_ = np;
+			moved += e->size_;
+		}
+
+		if (!src->get_allocated_space())
+			empty.push_back(src);
+	}
+
+	for (auto v: empty) {
+		if (!file_ && hs_.size() > 1) //the file doesn't shrink, its chunks stay to be reused
+			release_chunk(v);
+	}
+
+	check_pressure(ev);
+	return moved;
+}
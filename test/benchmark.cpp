@@ -5,6 +5,10 @@
 #include <cstdlib>
 #include <assert.h>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <algorithm>
 
 namespace chrono=std::chrono;
 using namespace memheap;
@@ -69,6 +73,7 @@ void range_benchmark(msize from, msize to, msize alloc_num, bool thread_safe)
 	std::cout << "Random allocations in ranges [0, " << from << "] ... [0, " << to << "] bytes, and " << alloc_num + alloc_num/2 << " allocations per test" << std::endl;
 
 	float diff{};
+	float qdiff{};
 
 	msize lcnt = 0;
 	for (msize i = from; i <= to; i *= 2, ++lcnt) {
@@ -105,16 +110,273 @@ void range_benchmark(msize from, msize to, msize alloc_num, bool thread_safe)
 			heap hc(thread_safe, MAX_ALLOC_SIZE, mi.size());
 
 			memory mem;
-			mem.alloc_ = std::bind(&heap::allocate, &hc, _1);
-			mem.free_ = std::bind(&heap::free, &hc, _1);
+			mem.alloc_ = [&hc](msize n) { return hc.allocate(n); };
+			mem.free_ = [&hc](void* p) { hc.free(p); };
 
 			ft2 = benchmark(MAX_ALLOC_SIZE, mi, mem);
 		}
 
+		float ft3{};
+		{
+			heap_options opt;
+			opt.quick_list_budget = 256*1024;
+			heap hc(thread_safe, MAX_ALLOC_SIZE, mi.size(), opt);
+
+			memory mem;
+			mem.alloc_ = [&hc](msize n) { return hc.allocate(n); };
+			mem.free_ = [&hc](void* p) { hc.free(p); };
+
+			ft3 = benchmark(MAX_ALLOC_SIZE, mi, mem);
+		}
+
 		diff += ft1/ft2;
+		qdiff += ft1/ft3;
 	}
 
 	std::cout << "[malloc speed]/[memheap speed]=" << diff/(float)lcnt << std::endl;
+	std::cout << "[malloc speed]/[memheap deferred coalescing speed]=" << qdiff/(float)lcnt << std::endl;
+}
+
+void hint_benchmark(msize max_alloc_size, msize alloc_num, msize est_max_size, msize est_cnt)
+{
+	std::cout << "Hints est_max_size=" << est_max_size << " est_cnt=" << est_cnt 
+		<< " for random allocations in range [0, " << max_alloc_size << "] bytes, and " << alloc_num + alloc_num/2 << " allocations" << std::endl;
+
+	std::vector<meminfo> mi;
+	float k = ((float)max_alloc_size) / (float)RAND_MAX;
+	for (msize i = 0; i != alloc_num; ++i) {
+		msize n =  static_cast<msize>((float)std::rand() * k);
+		meminfo inf(n? n: 1);
+		inf.rnd_size_ = static_cast<msize>((float)std::rand() * k);
+		if (!inf.rnd_size_)
+			inf.rnd_size_ = 1;
+		mi.push_back(inf);
+	}
+
+	for (int adaptive = 0; adaptive != 2; ++adaptive) {
+		heap_options opt;
+		opt.adaptive_chunks = adaptive;
+		heap hc(false, est_max_size, est_cnt, opt);
+
+		memory mem;
+		mem.alloc_ = [&hc](msize n) { return hc.allocate(n); };
+		mem.free_ = [&hc](void* p) { hc.free(p); };
+
+		unsigned long tm = benchmark(max_alloc_size, mi, mem);
+
+		std::cout << (adaptive? "adaptive chunks": "fixed chunks   ") 
+			<< ": " << tm << " us, footprint " << hc.get_total_size()/1024 << " KB in " << hc.get_chunk_count() << " chunks" << std::endl;
+	}
+}
+
+//rounds of short lived churn, each leaving a few long lived objects behind
+void lifetime_benchmark(msize max_alloc_size, msize rounds, msize round_num)
+{
+	std::cout << "Mixed lifetimes, " << rounds << " rounds of " << round_num 
+		<< " short lived allocations in range [0, " << max_alloc_size << "] bytes, every 64th one is long lived" << std::endl;
+
+	std::vector<msize> sizes;
+	float k = ((float)max_alloc_size) / (float)RAND_MAX;
+	for (msize i = 0; i != round_num; ++i) {
+		msize n =  static_cast<msize>((float)std::rand() * k);
+		sizes.push_back(n? n: 1);
+	}
+
+	for (int hinted = 0; hinted != 2; ++hinted) {
+		heap hc(false, max_alloc_size, round_num);
+		std::vector<void*> shortmem(round_num);
+		std::vector<void*> longmem;
+
+		auto start = chrono::high_resolution_clock::now();
+		for (msize r = 0; r != rounds; ++r) {
+			for (msize i = 0; i != round_num; ++i) {
+				shortmem[i] = hinted? hc.allocate(sizes[i], lifetime::short_lived): hc.allocate(sizes[i]);
+				if (i % 64 == 0)
+					longmem.push_back(hinted? hc.allocate(sizes[i], lifetime::long_lived): hc.allocate(sizes[i]));
+			}
+			for (auto v: shortmem) {
+				hc.free(v);
+			}
+			hc.trim();
+		}
+		auto tm = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+
+		std::cout << (hinted? "lifetime hints": "no hints      ") 
+			<< ": " << tm << " us, footprint " << hc.get_total_size()/1024 << " KB in " << hc.get_chunk_count() << " chunks"
+			<< " after the churn, long lived " << hc.get_lifetime_stats(hinted? lifetime::long_lived: lifetime::normal).allocated_/1024 << " KB" << std::endl;
+
+		for (auto v: longmem) {
+			hc.free(v);
+		}
+	}
+}
+
+//one thread allocates, the workers free what it hands them in batches
+void pipeline_benchmark(msize max_alloc_size, msize alloc_num, msize workers)
+{
+	std::cout << "Producer/consumer, " << alloc_num << " allocations in range [0, " << max_alloc_size 
+		<< "] bytes freed by " << workers << " worker threads" << std::endl;
+
+	const msize BATCH = 64;
+	float k = ((float)max_alloc_size) / (float)RAND_MAX;
+
+	for (int deferred = 0; deferred != 2; ++deferred) {
+		heap_options opt;
+		opt.deferred_free = deferred;
+		heap hc(true, max_alloc_size, alloc_num / 8, opt);
+
+		std::mutex m;
+		std::vector<std::vector<void*>> batches;
+		bool done = false;
+		long long freetm = 0; //spent in free() by all workers
+
+		auto start = chrono::high_resolution_clock::now();
+
+		std::vector<std::thread> ts;
+		for (msize t = 0; t != workers; ++t) {
+			ts.emplace_back([&]() {
+				std::vector<void*> b;
+				long long tm = 0;
+				for (;;) {
+					{
+						std::lock_guard<std::mutex> lk(m);
+						if (!batches.empty()) {
+							b.swap(batches.back());
+							batches.pop_back();
+						}
+						else if (done)
+							break;
+					}
+					auto fs = chrono::high_resolution_clock::now();
+					for (auto v: b) {
+						hc.free(v);
+					}
+					tm += chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - fs).count();
+					if (b.empty())
+						std::this_thread::yield();
+					b.clear();
+				}
+				std::lock_guard<std::mutex> lk(m);
+				freetm += tm;
+			});
+		}
+
+		std::vector<void*> b;
+		for (msize i = 0; i != alloc_num; ++i) {
+			msize n = static_cast<msize>((float)std::rand() * k);
+			b.push_back(hc.allocate(n? n: 1));
+			if (b.size() == BATCH) {
+				std::lock_guard<std::mutex> lk(m);
+				batches.push_back(std::move(b));
+				b.clear();
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lk(m);
+			batches.push_back(std::move(b));
+			done = true;
+		}
+		for (auto& t: ts) {
+			t.join();
+		}
+		hc.flush_frees();
+
+		auto tm = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+		std::cout << (deferred? "deferred free": "locked free  ") << ": " << tm << " us, workers spent " << freetm << " us in free()" << std::endl;
+	}
+}
+
+//a long run of random replacements whose size mix changes every phase,
+//the same sequence for every fit policy
+void fragmentation_benchmark(msize live_num, msize phases, msize phase_steps)
+{
+	std::cout << "Fragmentation, " << live_num << " live blocks, " << phases << " phases of " << phase_steps 
+		<< " random replacements, sizes switch between [16, 256] and [16, 4096] bytes" << std::endl;
+
+	const char* names[] = {"first fit      ", "best fit       ", "address ordered"};
+	fit_policy policies[] = {fit_policy::first_fit, fit_policy::best_fit, fit_policy::address_ordered};
+
+	for (int i = 0; i != 3; ++i) {
+		heap_options opt;
+		opt.fit = policies[i];
+		heap hc(false, 1024, live_num / 8, opt);
+
+		std::mt19937 rnd(12345);
+		std::vector<void*> mem(live_num, nullptr);
+		std::vector<msize> sizes(live_num, 0);
+		msize live = 0;
+		msize peak = 0;
+		msize steady = 0; //average after the first half of the phases
+		msize steady_live = 0;
+
+		auto start = chrono::high_resolution_clock::now();
+		for (msize ph = 0; ph != phases; ++ph) {
+			msize max_size = ph % 2? 4096: 256;
+			for (msize j = 0; j != phase_steps; ++j) {
+				msize k = rnd() % live_num;
+				if (mem[k]) {
+					hc.free(mem[k]);
+					live -= sizes[k];
+				}
+				sizes[k] = 16 + rnd() % (max_size - 15);
+				mem[k] = hc.allocate(sizes[k]);
+				live += sizes[k];
+				peak = std::max(peak, hc.get_total_size());
+			}
+			hc.trim();
+			if (ph >= phases / 2) {
+				steady += hc.get_total_size() / (phases - phases / 2);
+				steady_live += live / (phases - phases / 2);
+			}
+		}
+		auto tm = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+
+		std::cout << names[i] << ": " << tm << " us, peak footprint " << peak/1024 << " KB, steady footprint " << steady/1024 
+			<< " KB for " << steady_live/1024 << " KB live" << std::endl;
+
+		for (auto v: mem) {
+			hc.free(v);
+		}
+	}
+}
+
+//random replacements of small blocks, freed with their size
+void small_block_benchmark(msize live_num, msize steps)
+{
+	std::cout << "Small blocks, " << live_num << " live blocks of [8, 64] bytes, " << steps << " random replacements" << std::endl;
+
+	const char* names[] = {"headers, free(p)      ", "header-less, free(p, n)"};
+
+	for (int i = 0; i != 2; ++i) {
+		heap_options opt;
+		opt.small_block_size = i? 64: 0;
+		heap hc(false, 64, live_num, opt);
+
+		std::mt19937 rnd(12345);
+		std::vector<void*> mem(live_num, nullptr);
+		std::vector<msize> sizes(live_num, 0);
+
+		auto start = chrono::high_resolution_clock::now();
+		for (msize j = 0; j != steps; ++j) {
+			msize k = rnd() % live_num;
+			if (mem[k]) {
+				if (i)
+					hc.free(mem[k], sizes[k]);
+				else
+					hc.free(mem[k]);
+			}
+			sizes[k] = 8 + rnd() % 57;
+			mem[k] = hc.allocate(sizes[k]);
+			*static_cast<char*>(mem[k]) = 1;
+		}
+		auto tm = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+
+		std::cout << names[i] << ": " << tm << " us, footprint " << (hc.get_total_size() - hc.get_free_space())/1024 << " KB" << std::endl;
+
+		for (msize j = 0; j != live_num; ++j) {
+			hc.free(mem[j], sizes[j]);
+		}
+	}
 }
 
 int main()
@@ -148,6 +410,37 @@ int main()
 	range_benchmark(512*1024, 1024*1024, 1000, true);
 	std::cout << std::endl;
 
+	std::cout << std::endl;
+	std::cout << "CHUNK SIZING WITH WRONG HINTS" << std::endl;
+	hint_benchmark(512, 10000, 512, 10000);
+	std::cout << std::endl;
+	hint_benchmark(512, 10000, 512, 10);
+	std::cout << std::endl;
+	hint_benchmark(512, 10000, 4*512, 4*10000);
+	std::cout << std::endl;
+
+	std::cout << std::endl;
+	std::cout << "SHORT AND LONG LIVED OBJECTS" << std::endl;
+	lifetime_benchmark(512, 100, 10000);
+	std::cout << std::endl;
+	lifetime_benchmark(4*1024, 100, 1000);
+	std::cout << std::endl;
+
+	std::cout << std::endl;
+	std::cout << "CROSS-THREAD FREE" << std::endl;
+	pipeline_benchmark(256, 1000000, 2);
+	std::cout << std::endl;
+	pipeline_benchmark(256, 1000000, 4);
+	std::cout << std::endl;
+
+	std::cout << std::endl;
+	std::cout << "FIT POLICIES" << std::endl;
+	fragmentation_benchmark(20000, 12, 100000);
+	std::cout << std::endl;
+
+	small_block_benchmark(1000000, 10000000);
+	std::cout << std::endl;
+
 	return 0;
 }
 
@@ -1,7 +1,19 @@
 #include <memheap/allocator.h>
+#include <memheap/pool_allocator.h>
+#include <memheap/epoch.h>
 #include <memory>
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <cstdio>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <random>
 
 using namespace memheap;
 
@@ -36,6 +48,93 @@ TEST_F(HeapTest, TestLimits)
     EXPECT_EQ(nullptr, hc_->allocate(1));
 }
 
+TEST_F(HeapTest, TestBlockOverhead)
+{
+	hc_.reset(new heap_chunk(1024*1024));
+
+#ifdef MEMHEAP_COMPACT_TAGS
+	EXPECT_EQ(sizeof(msize), heap_chunk::get_block_overhead());
+	EXPECT_EQ(3*sizeof(msize), heap_chunk::get_min_alloc_size());
+#else
+	EXPECT_EQ(2*sizeof(msize), heap_chunk::get_block_overhead());
+#endif
+
+	std::vector<void*> mem;
+	for (msize sz = 1; sz != 128; ++sz) {
+		msize block = (sz + heap_chunk::get_block_overhead() + sizeof(msize) - 1) / sizeof(msize) * sizeof(msize);
+		block = std::max(block, heap_chunk::get_min_alloc_size());
+
+		msize a = hc_->get_allocated_space();
+		void* p = hc_->allocate(sz);
+		ASSERT_NE(nullptr, p);
+		EXPECT_EQ(0, (msize)p % sizeof(msize));
+		EXPECT_EQ(block, hc_->get_allocated_space() - a);
+		memset(p, 0xff, sz);
+		mem.push_back(p);
+	}
+	for (msize i = 0; i < mem.size(); i += 2) {
+		hc_->free(mem[i]);
+	}
+	for (msize i = 1; i < mem.size(); i += 2) {
+		hc_->free(mem[i]);
+	}
+	EXPECT_EQ(0, hc_->get_allocated_space());
+	EXPECT_NE(nullptr, hc_->allocate(1024*1024));
+}
+
+TEST_F(HeapTest, TestFitPolicies)
+{
+	//two blocks of the same size class, separated by busy ones
+	auto run = [this](fit_policy fp, msize sz1, msize sz2) -> int {
+		hc_.reset(new heap_chunk(64*1024));
+		hc_->set_fit_policy(fp);
+		void* p1 = hc_->allocate(sz1);
+		hc_->allocate(64);
+		void* p2 = hc_->allocate(sz2);
+		hc_->allocate(64);
+
+		hc_->free(p1);
+		hc_->free(p2);
+		void* p = hc_->allocate(std::min(sz1, sz2) - 16);
+		EXPECT_TRUE(hc_->check());
+		return p == p1? 1: p == p2? 2: 0;
+	};
+
+	EXPECT_EQ(2, run(fit_policy::first_fit, 300, 400)); //the last freed
+	EXPECT_EQ(1, run(fit_policy::best_fit, 300, 400));
+	EXPECT_EQ(2, run(fit_policy::best_fit, 400, 300));
+	EXPECT_EQ(1, run(fit_policy::address_ordered, 400, 300));
+
+	//the lists stay consistent through splits and merges
+	for (fit_policy fp: {fit_policy::best_fit, fit_policy::address_ordered}) {
+		hc_.reset(new heap_chunk(1024*1024));
+		std::vector<void*> mem;
+		for (msize i = 0; i != 1000; ++i) {
+			mem.push_back(hc_->allocate(16 + i * 7 % 500));
+		}
+		for (msize i = 0; i < mem.size(); i += 3) {
+			hc_->free(mem[i]);
+			mem[i] = nullptr;
+		}
+		hc_->set_fit_policy(fp); //orders what's already free
+		for (msize i = 0; i < mem.size(); ++i) {
+			if (mem[i]) {
+				hc_->free(mem[i]);
+				mem[i] = nullptr;
+			}
+			if (i % 2)
+				mem[i] = hc_->allocate(16 + i * 5 % 500);
+		}
+		EXPECT_TRUE(hc_->check());
+		for (auto v: mem) {
+			if (v)
+				hc_->free(v);
+		}
+		EXPECT_TRUE(hc_->check());
+		EXPECT_EQ(0, hc_->get_allocated_space());
+	}
+}
+
 TEST_F(HeapTest, TestApi)
 {
 	const msize sz = 100*1024*1024;
@@ -79,6 +178,134 @@ TEST_F(HeapTest, TestApi)
     EXPECT_EQ(freesz, hc_->get_free_space());
 }
 
+TEST_F(HeapTest, TestZeroed)
+{
+	hc_.reset(new heap_chunk(1024*1024));
+
+	std::vector<unsigned char*> mem;
+	for (msize i = 1; i < 1024; i += 7) {
+		unsigned char* p = (unsigned char*)hc_->allocate_zeroed(i);
+		ASSERT_NE(nullptr, p);
+		for (msize j = 0; j != i; ++j) {
+			ASSERT_EQ(0, p[j]);
+		}
+		memset(p, 0xff, i);
+		mem.push_back(p);
+	}
+
+	for (msize i = 0; i < mem.size(); i += 2) {
+		hc_->free(mem[i]);
+	}
+
+	for (msize i = 1; i < 2048; i += 5) {
+		unsigned char* p = (unsigned char*)hc_->allocate_zeroed(i);
+		ASSERT_NE(nullptr, p);
+		for (msize j = 0; j != i; ++j) {
+			ASSERT_EQ(0, p[j]);
+		}
+		memset(p, 0xff, i);
+	}
+
+	//interleaved at the edge of the clean part, a block freed there takes in the free node
+	//of the rest of the chunk which may straddle that edge, another free block in the same bucket
+	//keeps the node's link non zero
+	auto take = [this](msize n) -> unsigned char* {
+		unsigned char* p = (unsigned char*)hc_->allocate_zeroed(n);
+		if (p) {
+			for (msize j = 0; j != n; ++j) {
+				EXPECT_EQ(0, p[j]);
+				if (p[j])
+					break;
+			}
+			memset(p, 0xff, n);
+		}
+		return p;
+	};
+
+	for (unsigned seed = 1; seed != 9; ++seed) {
+		std::mt19937 rnd(seed);
+		std::vector<unsigned char*> live;
+		hc_.reset();
+		for (msize i = 0; i != 20000 && !HasFailure(); ++i) {
+			if (!hc_) {
+				hc_.reset(new heap_chunk(240*1024));
+				live.clear();
+				unsigned char* p = take(120000);
+				take(16);
+				hc_->free(p);
+			}
+
+			if (!live.empty() && !(rnd() % 4)) {
+				msize k = rnd() % live.size();
+				hc_->free(live[k]);
+				live[k] = live.back();
+				live.pop_back();
+				continue;
+			}
+
+			msize n = 1 + rnd() % 256;
+			msize d = 1 + rnd() % 24;
+			unsigned char* p = take(n);
+			if (p) {
+				hc_->free(p);
+				p = take(n + d);
+			}
+			if (p) {
+				hc_->free(p);
+				p = take(n + d + rnd() % 256);
+			}
+			if (p)
+				live.push_back(p);
+			else
+				hc_.reset();
+		}
+	}
+
+	h_.reset(new heap(false, 1024, 16));
+	const msize big = 4*1024*1024;
+	unsigned char* p = (unsigned char*)h_->allocate(big);
+	memset(p, 0xff, big);
+	h_->free(p);
+	p = (unsigned char*)h_->allocate_zeroed(big);
+	for (msize j = 0; j != big; ++j) {
+		ASSERT_EQ(0, p[j]);
+	}
+	h_->free(p);
+}
+
+TEST_F(HeapTest, TestQuickLists)
+{
+	hc_.reset(new heap_chunk(64*1024));
+	hc_->set_quick_budget(16*1024);
+
+	msize freesz = hc_->get_free_space();
+
+	std::vector<void*> mem;
+	for (msize i = 0; i != 256; ++i) {
+		void* p = hc_->allocate(64 + i % 4 * 8);
+		ASSERT_NE(nullptr, p);
+		mem.push_back(p);
+	}
+
+	hc_->free(mem[10]);
+	EXPECT_EQ(mem[10], hc_->allocate(64 + 10 % 4 * 8)); //same size block is reused as is
+
+	for (auto v: mem) {
+		hc_->free(v);
+	}
+	EXPECT_EQ(freesz, hc_->get_free_space());
+
+	//a miss coalesces the deferred blocks
+	void* p = hc_->allocate(48*1024);
+	EXPECT_NE(nullptr, p);
+	hc_->free(p);
+
+	hc_->flush_quick();
+	EXPECT_EQ(freesz, hc_->get_free_space());
+	p = hc_->allocate(freesz - 2*sizeof(msize));
+	EXPECT_NE(nullptr, p);
+}
+
 TEST_F(HeapTest, TestFullHeap)
 {
 	const msize sz = 1024;
@@ -117,6 +344,75 @@ TEST_F(HeapTest, TestFullHeap)
     }
 }
 
+TEST_F(HeapTest, TestSpareChunks)
+{
+	heap_options opt;
+	opt.spare_chunks = 2;
+	h_.reset(new heap(true, 1024, 8, opt));
+	EXPECT_EQ(0, h_->get_spare_chunks());
+
+	std::vector<void*> mem;
+	for (msize i = 0; i != 64; ++i) {
+		void* p = h_->allocate(1024);
+		ASSERT_NE(nullptr, p);
+		memset(p, 0, 1024);
+		mem.push_back(p);
+	}
+
+	for (int i = 0; i != 1000 && h_->get_spare_chunks() != 2; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	EXPECT_EQ(2, h_->get_spare_chunks());
+
+	for (auto v: mem) {
+		h_->free(v);
+	}
+	h_.reset();
+}
+
+TEST_F(HeapTest, TestAdaptiveChunks)
+{
+	heap_options opt;
+	opt.adaptive_chunks = true;
+	opt.max_chunk_size = 4*1024*1024;
+
+	//too small hint
+	h_.reset(new heap(false, 16, 1, opt));
+	std::vector<void*> mem;
+	for (msize i = 0; i != 100000; ++i) {
+		void* p = h_->allocate(100);
+		ASSERT_NE(nullptr, p);
+		mem.push_back(p);
+	}
+	EXPECT_GT(32, h_->get_chunk_count());
+
+	heap fixed(false, 16, 1);
+	for (msize i = 0; i != 2000; ++i) {
+		fixed.allocate(100);
+	}
+	EXPECT_LT(1000, fixed.get_chunk_count());
+
+	for (auto v: mem) {
+		h_->free(v);
+	}
+
+	//too big hint
+	h_.reset(new heap(false, 1024*1024, 1024*1024, opt));
+	EXPECT_GE(opt.max_chunk_size + 1024, h_->get_total_size());
+	for (msize i = 0; i != 1000; ++i) {
+		EXPECT_NE(nullptr, h_->allocate(100));
+	}
+	EXPECT_EQ(1, h_->get_chunk_count());
+
+	//spares built for the old chunk size don't hold the growth back
+	opt.spare_chunks = 2;
+	h_.reset(new heap(true, 16, 1, opt));
+	for (msize i = 0; i != 200000; ++i) {
+		ASSERT_NE(nullptr, h_->allocate(100));
+	}
+	EXPECT_GT(32, h_->get_chunk_count());
+}
+
 TEST_F(HeapTest, TestStdAllocator)
 {
     struct testval
@@ -161,6 +457,823 @@ TEST_F(HeapTest, TestStdAllocator)
 	free_std_allocator();
 }
 
+TEST_F(HeapTest, TestPoolAllocator)
+{
+	typedef std::map<int, int, std::less<int>, pool_allocator<std::pair<const int, int>>> poolmap;
+	typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, pool_allocator<std::pair<const int, int>>> poolhash;
+	typedef std::list<double, pool_allocator<double>> poollist;
+
+	for (int round = 0; round != 2; ++round) { //the pools start over with a new heap
+		init_std_allocator(round == 1, 1024, 64);
+
+		pool_allocator<double> a;
+		double* p = a.allocate(1);
+		a.deallocate(p, 1);
+		EXPECT_EQ(p, a.allocate(1)); //the node is reused as is
+		a.deallocate(p, 1);
+
+		double* arr = a.allocate(100);
+		std::fill(arr, arr + 100, 1.0);
+		a.deallocate(arr, 100);
+
+		{
+			poolmap m;
+			poolhash h;
+			poollist l;
+			for (int i = 0; i != 10000; ++i) {
+				m[i] = i;
+				h[i] = i;
+				l.push_back(i);
+			}
+			for (int i = 0; i < 10000; i += 2) {
+				m.erase(i);
+				h.erase(i);
+			}
+			for (int i = 1; i < 10000; i += 2) {
+				ASSERT_EQ(i, m[i]);
+				ASSERT_EQ(i, h[i]);
+			}
+			EXPECT_EQ(5000, m.size());
+			EXPECT_EQ(5000, h.size());
+			EXPECT_EQ(10000, l.size());
+		}
+		free_std_allocator();
+	}
+}
+
+TEST_F(HeapTest, TestUsableSize)
+{
+	h_.reset(new heap(true, 1024, 64));
+
+	EXPECT_EQ(0, h_->usable_size(nullptr));
+
+	for (msize i = 1; i != 2048; ++i) {
+		void* p = h_->allocate(i);
+		msize n = h_->usable_size(p);
+		EXPECT_LE(i, n);
+		EXPECT_GT(i + heap_chunk::get_min_alloc_size(), n);
+		memset(p, 0xcd, n);
+		h_->free(p);
+	}
+
+	//the rest of a free block that is too small to split off goes with the allocation
+	hc_.reset(new heap_chunk(1024));
+	msize fs = hc_->get_free_space();
+	void* p = hc_->allocate(fs - heap_chunk::get_block_overhead() - 8);
+	ASSERT_NE(nullptr, p);
+	EXPECT_EQ(fs - heap_chunk::get_block_overhead(), hc_->usable_size(p));
+	hc_->free(p);
+
+	heap::allocation_result r = h_->allocate_at_least(100);
+	ASSERT_NE(nullptr, r.ptr_);
+	EXPECT_EQ(h_->usable_size(r.ptr_), r.size_);
+	EXPECT_LE(100, r.size_);
+	h_->free(r.ptr_);
+	EXPECT_EQ(nullptr, h_->allocate_at_least(0).ptr_);
+
+	init_std_allocator(false, 1024, 64);
+	{
+		memheap::allocator<double> a;
+		for (msize i = 1; i != 100; ++i) {
+			auto ar = a.allocate_at_least(i);
+			EXPECT_LE(i, ar.count);
+			EXPECT_EQ(0, (size_t)ar.ptr % alignof(double));
+			std::fill(ar.ptr, ar.ptr + ar.count, 1.0);
+			a.deallocate(ar.ptr, ar.count);
+		}
+
+		memheap::allocator<char> ac;
+		auto ar = ac.allocate_at_least(3);
+		EXPECT_LE(3, ar.count);
+		memset(ar.ptr, 1, ar.count);
+		ac.deallocate(ar.ptr, ar.count);
+	}
+	free_std_allocator();
+}
+
+namespace
+{
+	struct small_object: std_heap_object
+	{
+		msize v_[3];
+	};
+}
+
+TEST_F(HeapTest, TestSmallBlocks)
+{
+	const msize cnt = 10000;
+
+	//footprint of cnt 16 byte blocks without and with the headers
+	msize used[2];
+	for (int i = 0; i != 2; ++i) {
+		heap_options opt;
+		opt.small_block_size = i? 64: 0;
+		heap h(false, 64, cnt, opt);
+		std::vector<void*> v;
+		for (msize j = 0; j != cnt; ++j) {
+			v.push_back(h.allocate(16));
+			memset(v.back(), 0xcd, 16);
+		}
+		used[i] = h.get_total_size() - h.get_free_space();
+		EXPECT_TRUE(h.check());
+		for (auto p: v) {
+			h.free(p, 16);
+		}
+	}
+	EXPECT_GT(used[0], used[1] + cnt * heap_chunk::get_block_overhead() / 2);
+
+	heap_options opt;
+	opt.small_block_size = 60; //rounded up to 64
+	h_.reset(new heap(true, 1024, 64, opt));
+
+	std::vector<std::pair<void*, msize>> v;
+	for (msize i = 1; i != 200; ++i) {
+		void* p = h_->allocate(i);
+		memset(p, int(i), i);
+		v.push_back({p, i});
+		if (i <= 64)
+			EXPECT_EQ((i + sizeof(msize) - 1) / sizeof(msize) * sizeof(msize), h_->usable_size(p));
+		else
+			EXPECT_LE(i, h_->usable_size(p));
+		EXPECT_EQ(0, (size_t)p % alignof(msize));
+	}
+	for (auto& e: v) {
+		for (msize j = 0; j != e.second; ++j) {
+			ASSERT_EQ(char(e.second), static_cast<char*>(e.first)[j]);
+		}
+	}
+
+	//sized and unsized frees, the freed small blocks come back first
+	for (msize i = 0; i != v.size(); ++i) {
+		if (i % 2)
+			h_->free(v[i].first, v[i].second);
+		else
+			h_->free(v[i].first);
+	}
+	void* p = h_->allocate(24);
+	EXPECT_TRUE(p == v[23].first || p == v[22].first || p == v[21].first);
+	h_->free(p, 24);
+
+	void* z = h_->allocate_zeroed(40);
+	for (msize j = 0; j != 40; ++j) {
+		ASSERT_EQ(0, static_cast<char*>(z)[j]);
+	}
+	h_->free(z);
+
+	heap::allocation_result r = h_->allocate_at_least(33);
+	EXPECT_EQ(40, r.size_);
+	EXPECT_EQ(h_->usable_size(r.ptr_), r.size_);
+	h_->free(r.ptr_, r.size_);
+
+	//each lifetime class gets small blocks of its own
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+	std::vector<void*> lv;
+	for (msize i = 0; i != 3000; ++i) {
+		lv.push_back(h_->allocate(16, lifetime::long_lived));
+		v[i % 100].first = h_->allocate(16, lifetime::short_lived);
+		h_->free(v[i % 100].first, 16);
+	}
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::short_lived).blocks_);
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+	heap::lifetime_stats ls = h_->get_lifetime_stats(lifetime::long_lived);
+	EXPECT_EQ(3000, ls.blocks_);
+	EXPECT_LE(3000*16, ls.allocated_);
+	EXPECT_EQ(1, ls.chunk_count_);
+	for (msize i = 0; i != lv.size(); ++i) {
+		EXPECT_EQ(16, h_->usable_size(lv[i]));
+		if (i % 2)
+			h_->free(lv[i], 16);
+		else
+			h_->free(lv[i]);
+	}
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::long_lived).blocks_);
+
+	//handle blocks stay movable
+	heap::handle hd = h_->allocate_handle(8);
+	EXPECT_NE(nullptr, h_->deref(hd));
+	h_->free_handle(hd);
+	EXPECT_TRUE(h_->check());
+
+	//trim() and compact() never leave a small block chunk as the one plain blocks come from
+	h_.reset(new heap(false, 1024, 1, opt));
+	void* big = h_->allocate(512);
+	void* sm = h_->allocate(16);
+	h_->free(big);
+	h_->trim();
+	big = h_->allocate(1000);
+	EXPECT_LE(1000, h_->usable_size(big));
+	h_->free(big, 1000);
+	h_->free(sm, 16);
+
+	std::mt19937 rnd(7);
+	std::vector<std::pair<void*, msize>> live;
+	std::vector<heap::handle> hds;
+	for (msize i = 0; i != 20000; ++i) {
+		msize k = rnd() % 4;
+		if (k == 0 && !live.empty()) {
+			msize j = rnd() % live.size();
+			h_->free(live[j].first, live[j].second);
+			live[j] = live.back();
+			live.pop_back();
+		}
+		else if (k == 1) {
+			msize n = 1 + rnd() % 2048;
+			void* q = h_->allocate(n);
+			memset(q, 0xab, n);
+			ASSERT_LE(n, h_->usable_size(q));
+			live.push_back({q, n});
+		}
+		else if (k == 2) {
+			if (!hds.empty() && rnd() % 2) {
+				h_->free_handle(hds.back());
+				hds.pop_back();
+			}
+			else
+				hds.push_back(h_->allocate_handle(16 + rnd() % 1024));
+		}
+		else {
+			msize n = 1 + rnd() % 64;
+			live.push_back({h_->allocate(n, static_cast<lifetime>(rnd() % LIFETIME_CLASSES)), n});
+		}
+		if (i % 1000 == 0) {
+			h_->trim();
+			h_->compact(64*1024);
+			ASSERT_TRUE(h_->check());
+		}
+	}
+	for (auto& e: live) {
+		h_->free(e.first, e.second);
+	}
+	for (auto v: hds) {
+		h_->free_handle(v);
+	}
+	h_->trim();
+	EXPECT_TRUE(h_->check());
+
+	//plain blocks when a budget leaves no room for the slabs
+	opt.budget = 64*1024;
+	h_.reset(new heap(false, 64, 64, opt));
+	p = h_->allocate(16);
+	ASSERT_NE(nullptr, p);
+	EXPECT_LE(16, h_->usable_size(p));
+	h_->free(p, 16);
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+	EXPECT_TRUE(h_->check());
+	opt.budget = 0;
+
+	//std allocator and the class sized delete
+	init_std_allocator(false, 64, 1024, opt);
+	{
+		std::list<int, memheap::allocator<int>> l;
+		for (int i = 0; i != 1000; ++i) {
+			l.push_back(i);
+		}
+		EXPECT_EQ(999, l.back());
+
+		std::vector<small_object*> objs;
+		for (int i = 0; i != 1000; ++i) {
+			objs.push_back(new small_object);
+			objs.back()->v_[0] = i;
+		}
+		small_object* arr = new small_object[10];
+		for (auto o: objs) {
+			delete o;
+		}
+		delete[] arr;
+		EXPECT_TRUE(g_std_heap->check());
+	}
+	free_std_allocator();
+}
+
+TEST_F(HeapTest, TestCompact)
+{
+	h_.reset(new heap(false, 1024, 64));
+
+	std::vector<heap::handle> mem;
+	for (msize i = 0; i != 1024; ++i) {
+		heap::handle h = h_->allocate_handle(512);
+		ASSERT_NE(0, h);
+		memset(h_->deref(h), (int)(i & 0xff), 512);
+		mem.push_back(h);
+	}
+
+	char* pinned = (char*)h_->pin(mem[1]);
+
+	for (msize i = 0; i != mem.size(); ++i) {
+		if (i % 8 > 1) {
+			h_->free_handle(mem[i]);
+			mem[i] = 0;
+		}
+	}
+
+	msize freesz = h_->get_free_space();
+	EXPECT_LT(0, h_->compact(std::numeric_limits<msize>::max()));
+	EXPECT_GT(freesz, h_->get_free_space());
+
+	EXPECT_EQ(pinned, h_->deref(mem[1]));
+	h_->unpin(mem[1]);
+
+	for (msize i = 0; i != mem.size(); ++i) {
+		if (!mem[i])
+			continue;
+		unsigned char* p = (unsigned char*)h_->deref(mem[i]);
+		for (msize j = 0; j != 512; ++j) {
+			ASSERT_EQ(i & 0xff, p[j]);
+		}
+		h_->free_handle(mem[i]);
+	}
+}
+
+TEST_F(HeapTest, TestLifetimeHints)
+{
+	h_.reset(new heap(true, 1024, 64));
+
+	heap::lifetime_stats ls = h_->get_lifetime_stats(lifetime::long_lived);
+	EXPECT_EQ(0, ls.chunk_count_);
+	EXPECT_EQ(0, ls.total_size_);
+
+	std::vector<void*> shortmem;
+	std::vector<void*> longmem;
+	for (msize i = 0; i != 256; ++i) {
+		shortmem.push_back(h_->allocate(512, lifetime::short_lived));
+		longmem.push_back(h_->allocate(64, lifetime::long_lived));
+		memset(longmem.back(), 0xab, 64);
+	}
+	void* p = h_->allocate(100);
+
+	ls = h_->get_lifetime_stats(lifetime::long_lived);
+	EXPECT_EQ(256, ls.blocks_);
+	EXPECT_LE(256 * 64, ls.allocated_);
+	EXPECT_LT(0, ls.chunk_count_);
+
+	heap::lifetime_stats ss = h_->get_lifetime_stats(lifetime::short_lived);
+	EXPECT_EQ(256, ss.blocks_);
+	EXPECT_LE(256 * 512, ss.allocated_);
+
+	heap::lifetime_stats ns = h_->get_lifetime_stats(lifetime::normal);
+	EXPECT_EQ(1, ns.blocks_);
+	EXPECT_EQ(h_->get_total_size(), ns.total_size_ + ss.total_size_ + ls.total_size_);
+	EXPECT_EQ(h_->get_chunk_count(), ns.chunk_count_ + ss.chunk_count_ + ls.chunk_count_);
+
+	//the short lived churn leaves nothing behind in its chunks
+	for (auto v: shortmem) {
+		h_->free(v);
+	}
+	ss = h_->get_lifetime_stats(lifetime::short_lived);
+	EXPECT_EQ(0, ss.blocks_);
+	EXPECT_EQ(0, ss.allocated_);
+
+	msize total = h_->get_total_size();
+	EXPECT_LE(ss.total_size_, h_->trim());
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::short_lived).chunk_count_);
+	EXPECT_GT(total, h_->get_total_size());
+
+	for (auto v: longmem) {
+		for (msize j = 0; j != 64; ++j) {
+			ASSERT_EQ(0xab, ((unsigned char*)v)[j]);
+		}
+		h_->free(v);
+	}
+	h_->free(p);
+
+	//a class that lost its chunks gets new ones
+	p = h_->allocate(512, lifetime::short_lived);
+	EXPECT_EQ(1, h_->get_lifetime_stats(lifetime::short_lived).blocks_);
+	h_->free(p);
+}
+
+TEST_F(HeapTest, TestDeferredFree)
+{
+	heap_options opt;
+	opt.deferred_free = true;
+	h_.reset(new heap(true, 256, 1024, opt));
+
+	const msize THREADS = 4;
+	const msize NUM = 20000;
+	std::vector<void*> mem[THREADS];
+
+	for (msize i = 0; i != NUM; ++i) {
+		void* p = h_->allocate(16 + i % 256);
+		memset(p, 0xcd, 16);
+		mem[i % THREADS].push_back(p);
+	}
+
+	//the others free while this thread keeps the lock busy
+	std::atomic<bool> go(false);
+	std::vector<std::thread> ts;
+	for (msize t = 0; t != THREADS; ++t) {
+		ts.emplace_back([&, t]() {
+			while (!go)
+				std::this_thread::yield();
+			for (auto v: mem[t]) {
+				h_->free(v);
+			}
+		});
+	}
+	go = true;
+	for (msize i = 0; i != NUM; ++i) {
+		h_->free(h_->allocate(16 + i % 256));
+	}
+	for (auto& t: ts) {
+		t.join();
+	}
+
+	h_->flush_frees();
+	heap::lifetime_stats ls = h_->get_lifetime_stats(lifetime::normal);
+	EXPECT_EQ(0, ls.blocks_);
+	EXPECT_EQ(0, ls.allocated_);
+}
+
+TEST_F(HeapTest, TestEpochs)
+{
+	h_.reset(new heap(true, 64, 1024));
+
+	std::vector<void*> v;
+	for (msize i = 0; i != 100; ++i) {
+		v.push_back(h_->allocate(32));
+	}
+	v.push_back(nullptr);
+	h_->free_batch(v.data(), v.size());
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+
+	{
+		epoch_domain d(*h_);
+
+		//nothing retired while another thread is inside gets freed
+		std::atomic<int> step(0);
+		std::thread reader([&]() {
+			epoch_domain::guard g(d);
+			step = 1;
+			while (step != 2)
+				std::this_thread::yield();
+		});
+		while (step != 1)
+			std::this_thread::yield();
+
+		for (msize i = 0; i != 1000; ++i) {
+			epoch_domain::guard g(d);
+			d.retire(h_->allocate(32));
+		}
+		msize e = d.get_epoch();
+		for (int i = 0; i != 10; ++i) {
+			d.collect();
+		}
+		EXPECT_EQ(1000, h_->get_lifetime_stats(lifetime::normal).blocks_);
+		EXPECT_GE(e + 1, d.get_epoch());
+
+		step = 2;
+		reader.join();
+		for (int i = 0; i != 3; ++i) {
+			d.collect();
+		}
+		EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+
+		//lock-free stack, the popped nodes are retired while other threads may still read them
+		struct node
+		{
+			node* next_;
+			msize v_;
+		};
+		std::atomic<node*> top(nullptr);
+		const msize THREADS = 4;
+		const msize NUM = 20000;
+		std::atomic<msize> sum(0);
+		std::vector<std::thread> ts;
+		for (msize t = 0; t != THREADS; ++t) {
+			ts.emplace_back([&, t]() {
+				for (msize i = 0; i != NUM; ++i) {
+					node* n = static_cast<node*>(h_->allocate(sizeof(node)));
+					n->v_ = t * NUM + i;
+					n->next_ = top.load();
+					while (!top.compare_exchange_weak(n->next_, n))
+						;
+
+					epoch_domain::guard g(d);
+					node* p = top.load();
+					while (p && !top.compare_exchange_weak(p, p->next_))
+						;
+					if (p) {
+						sum += p->v_;
+						d.retire(p);
+					}
+				}
+			});
+		}
+		for (auto& t: ts) {
+			t.join();
+		}
+		for (node* p = top.load(); p; p = p->next_) {
+			sum += p->v_;
+		}
+		EXPECT_EQ(THREADS * NUM * (THREADS * NUM - 1) / 2, sum.load());
+
+		//what the exited threads left in their bags
+		d.synchronize();
+		msize left = 0;
+		for (node* p = top.load(); p; p = p->next_) {
+			++left;
+		}
+		EXPECT_EQ(left, h_->get_lifetime_stats(lifetime::normal).blocks_);
+
+		node* p = top.load();
+		while (p) {
+			node* next = p->next_;
+			h_->free(p);
+			p = next;
+		}
+	}
+	//the domain frees the rest
+	EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+	EXPECT_TRUE(h_->check());
+
+	//sized retire of small blocks
+	heap_options opt;
+	opt.small_block_size = 64;
+	h_.reset(new heap(true, 64, 1024, opt));
+	{
+		epoch_domain d(*h_);
+		std::thread t([&]() {
+			for (msize i = 0; i != 1000; ++i) {
+				epoch_domain::guard g(d);
+				d.retire(h_->allocate(24), 24);
+			}
+		});
+		t.join();
+		EXPECT_LT(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+		d.synchronize();
+		EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+
+		std::vector<void*> v;
+		std::vector<msize> n;
+		for (msize i = 1; i != 100; ++i) {
+			v.push_back(h_->allocate(i));
+			n.push_back(i);
+		}
+		h_->free_batch(v.data(), n.data(), v.size());
+		EXPECT_EQ(0, h_->get_lifetime_stats(lifetime::normal).blocks_);
+	}
+	EXPECT_TRUE(h_->check());
+}
+
+TEST_F(HeapTest, TestFileHeap)
+{
+	struct root
+	{
+		msize cnt_;
+		msize items_[1000]; //offsets from the root
+	};
+
+	const std::string path = testing::TempDir() + "memheap_test.heap";
+	const std::string copy = path + ".copy";
+	std::remove(path.c_str());
+	std::remove(copy.c_str());
+
+	heap_options opt;
+	opt.file_path = path;
+	opt.file_capacity = 256*1024*1024;
+
+	msize used = 0;
+	{
+		heap h(false, 256, 1024, opt);
+		EXPECT_FALSE(h.is_recovered());
+		EXPECT_EQ(nullptr, h.get_root());
+
+		root* r = (root*)h.allocate(sizeof(root));
+		r->cnt_ = 0;
+		for (msize i = 0; i != 1000; ++i) {
+			char* p = (char*)h.allocate(16 + i % 512);
+			memset(p, (int)(i & 0xff), 16 + i % 512);
+			r->items_[r->cnt_++] = p - (char*)r;
+			if (i % 3 == 0) //leave some holes
+				h.free(h.allocate(64));
+		}
+		void* big = h.allocate(4*1024*1024);
+		memset(big, 0xab, 4*1024*1024);
+		h.free(big);
+		h.set_root(r);
+		used = h.get_lifetime_stats(lifetime::normal).allocated_;
+
+		//what a crash would leave behind
+		std::ifstream src(path, std::ios::binary);
+		std::ofstream dst(copy, std::ios::binary);
+		dst << src.rdbuf();
+	}
+
+	auto verify = [used](heap& h) {
+		EXPECT_TRUE(h.check());
+		heap::lifetime_stats ls = h.get_lifetime_stats(lifetime::normal);
+		EXPECT_EQ(used, ls.allocated_);
+		EXPECT_EQ(1001, ls.blocks_);
+
+		root* r = (root*)h.get_root();
+		ASSERT_NE(nullptr, r);
+		ASSERT_EQ(1000, r->cnt_);
+		for (msize i = 0; i != r->cnt_; ++i) {
+			unsigned char* p = (unsigned char*)r + r->items_[i];
+			for (msize j = 0; j != 16 + i % 512; ++j) {
+				ASSERT_EQ(i & 0xff, p[j]);
+			}
+			h.free(p);
+		}
+		h.free(r);
+		EXPECT_EQ(0, h.get_lifetime_stats(lifetime::normal).allocated_);
+		EXPECT_NE(nullptr, h.allocate(4*1024*1024));
+		EXPECT_TRUE(h.check());
+	};
+
+	{
+		heap h(false, 1, 1, opt);
+		EXPECT_FALSE(h.is_recovered());
+		verify(h);
+	}
+
+	opt.file_path = copy;
+	{
+		heap h(true, 1, 1, opt);
+		EXPECT_TRUE(h.is_recovered());
+		verify(h);
+	}
+
+	//not a heap file
+	{
+		std::ofstream f(copy, std::ios::binary | std::ios::trunc);
+		f << std::string(8192, 'x');
+	}
+	EXPECT_THROW(heap(false, 1, 1, opt), std::runtime_error);
+
+	//blocks on the quick lists when it crashed are free after the rebuild
+	std::remove(path.c_str());
+	opt.file_path = path;
+	opt.quick_list_budget = 1024*1024;
+	{
+		heap h(false, 512, 1024, opt);
+		void* r = h.allocate(64);
+		h.set_root(r);
+		std::vector<void*> mem;
+		for (msize i = 0; i != 1024; ++i) {
+			mem.push_back(h.allocate(300 + i % 256));
+		}
+		for (auto p: mem) {
+			h.free(p);
+		}
+
+		std::ifstream src(path, std::ios::binary);
+		std::ofstream dst(copy, std::ios::binary);
+		dst << src.rdbuf();
+	}
+	opt.file_path = copy;
+	{
+		heap h(false, 1, 1, opt);
+		EXPECT_TRUE(h.is_recovered());
+		EXPECT_TRUE(h.check());
+		EXPECT_EQ(1, h.get_lifetime_stats(lifetime::normal).blocks_);
+		h.free(h.get_root());
+		EXPECT_EQ(0, h.get_lifetime_stats(lifetime::normal).allocated_);
+	}
+
+	//compact() keeps the emptied chunks of the file
+	std::remove(path.c_str());
+	opt.file_path = path;
+	opt.quick_list_budget = 0;
+	msize chunks = 0;
+	{
+		heap h(false, 512, 256, opt);
+		std::vector<heap::handle> mem;
+		for (msize i = 0; i != 1024; ++i) {
+			mem.push_back(h.allocate_handle(512));
+		}
+		for (msize i = 0; i != mem.size(); ++i) {
+			if (i % 4) {
+				h.free_handle(mem[i]);
+				mem[i] = 0;
+			}
+		}
+		EXPECT_LT(0, h.compact(std::numeric_limits<msize>::max()));
+		EXPECT_TRUE(h.check());
+		for (auto v: mem) {
+			if (v)
+				h.free_handle(v);
+		}
+		chunks = h.get_chunk_count();
+		EXPECT_LT(1, chunks);
+	}
+	{
+		heap h(false, 1, 1, opt);
+		EXPECT_FALSE(h.is_recovered());
+		EXPECT_TRUE(h.check());
+		EXPECT_EQ(chunks, h.get_chunk_count());
+		EXPECT_EQ(0, h.get_lifetime_stats(lifetime::normal).allocated_);
+		for (msize i = 0; i != 1024; ++i) {
+			ASSERT_NE(nullptr, h.allocate(512));
+		}
+		EXPECT_EQ(chunks, h.get_chunk_count());
+	}
+
+	std::remove(path.c_str());
+	std::remove(copy.c_str());
+
+	//not a file heap, no root
+	h_.reset(new heap(false, 256, 16));
+	h_->set_root(h_->allocate(16));
+	EXPECT_EQ(nullptr, h_->get_root());
+	EXPECT_FALSE(h_->is_recovered());
+}
+
+TEST_F(HeapTest, TestBudget)
+{
+	heap_options opt;
+	opt.budget = 1024*1024;
+	opt.soft_limit = 256*1024;
+	opt.hard_limit = 512*1024;
+	h_.reset(new heap(true, 1024, 1024, opt));
+	EXPECT_GE(opt.budget, h_->get_total_size());
+
+	std::vector<pressure> levels;
+	std::vector<void*> cache; //what the callback may shed
+	msize id = h_->add_pressure_callback([&](pressure l, msize allocated) {
+		levels.push_back(l);
+		if (l == pressure::hard) {
+			EXPECT_LE(opt.hard_limit, allocated);
+			for (msize i = 0; i != 8 && !cache.empty(); ++i) {
+				h_->free(cache.back());
+				cache.pop_back();
+			}
+		}
+	});
+
+	std::vector<void*> mem;
+	for (msize i = 0; i != 256; ++i) {
+		cache.push_back(h_->allocate(1024));
+	}
+	EXPECT_EQ(pressure::soft, h_->get_pressure());
+
+	for (;;) {
+		void* p = h_->try_allocate(1024);
+		if (!p)
+			break;
+		mem.push_back(p);
+	}
+	EXPECT_GE(opt.budget, h_->get_total_size());
+	EXPECT_LT(opt.budget / 2, h_->get_total_size());
+	EXPECT_THROW(h_->allocate(1024), std::bad_alloc);
+	EXPECT_EQ(nullptr, h_->try_allocate(2*opt.budget));
+
+	ASSERT_LE(3, levels.size());
+	EXPECT_EQ(pressure::soft, levels[0]);
+	EXPECT_EQ(pressure::hard, levels[1]);
+	EXPECT_EQ(pressure::soft, levels[2]); //the callback has shed some
+
+	h_->remove_pressure_callback(id);
+	msize cnt = levels.size();
+	for (auto v: mem) {
+		h_->free(v);
+	}
+	for (auto v: cache) {
+		h_->free(v);
+	}
+	EXPECT_EQ(cnt, levels.size());
+	EXPECT_EQ(pressure::normal, h_->get_pressure());
+
+	//the first chunk doesn't go over the budget for a big hint
+	h_.reset(new heap(false, 2*opt.budget, 1, opt));
+	EXPECT_GE(opt.budget, h_->get_total_size());
+	EXPECT_EQ(nullptr, h_->try_allocate(opt.budget));
+	EXPECT_NE(nullptr, h_->try_allocate(opt.budget / 2));
+
+	opt.budget = 16;
+	EXPECT_THROW(heap(false, 1024, 1024, opt), std::invalid_argument);
+}
+
+TEST_F(HeapTest, TestLatencyHistogram)
+{
+	latency_histogram lh;
+	EXPECT_EQ(0, lh.percentile(0.5));
+
+	for (std::uint64_t i = 1; i <= 100000; ++i) {
+		lh.record(i);
+	}
+	latency_percentiles lp = lh.get_percentiles();
+	EXPECT_EQ(100000, lp.count_);
+	EXPECT_EQ(100000, lp.max_);
+	EXPECT_NEAR(50000, lp.p50_, 50000/16);
+	EXPECT_NEAR(99000, lp.p99_, 99000/16);
+	EXPECT_NEAR(99900, lp.p999_, 99900/16);
+
+	h_.reset(new heap(true, 1024, 16));
+	for (msize i = 1; i != 1024; ++i) {
+		h_->free(h_->allocate(i));
+	}
+	heap::latency_report r = h_->get_latency();
+#ifdef MEMHEAP_LATENCY_STATS
+	EXPECT_EQ(1023, r.allocate_.count_);
+	EXPECT_EQ(1023, r.free_.count_);
+	EXPECT_EQ(2046, r.lock_wait_.count_);
+	EXPECT_LE(r.allocate_.p50_, r.allocate_.max_);
+#else
+	EXPECT_EQ(0, r.allocate_.count_);
+#endif
+}
+
 int main(int argc, char *argv[])
 {
 	testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,98 @@
+#include <memheap/allocator.h>
+#include <memheap/pool_allocator.h>
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+#include <unordered_map>
+#include <functional>
+
+namespace chrono=std::chrono;
+using namespace memheap;
+
+typedef std::pair<const int, int> value;
+
+//random inserts and erases, then everything is erased
+template <typename C>
+unsigned long container_benchmark(const std::vector<int>& keys, msize rounds)
+{
+	auto start = chrono::high_resolution_clock::now();
+
+	for (msize r = 0; r != rounds; ++r) {
+		C c;
+		for (auto k: keys) {
+			c[k] = k;
+		}
+		for (msize i = 0; i < keys.size(); i += 2) {
+			c.erase(keys[i]);
+		}
+		for (msize i = 0; i < keys.size(); i += 2) {
+			c[keys[i] + 1] = keys[i];
+		}
+		for (auto k: keys) {
+			c.erase(k);
+		}
+	}
+
+	return chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+}
+
+template <template <typename> class A>
+struct map_of
+{
+	typedef std::map<int, int, std::less<int>, A<value>> type;
+};
+
+template <template <typename> class A>
+struct hash_of
+{
+	typedef std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, A<value>> type;
+};
+
+template <typename T>
+using heap_allocator = memheap::allocator<T>;
+
+void run(msize num, msize rounds, bool thread_safe)
+{
+	std::cout << num << " keys, " << rounds << " rounds of insert/erase" << (thread_safe? ", thread safe heap": "") << std::endl;
+
+	std::vector<int> keys;
+	for (msize i = 0; i != num; ++i) {
+		keys.push_back(std::rand());
+	}
+
+	init_std_allocator(thread_safe, 64, num);
+
+	unsigned long tm = container_benchmark<map_of<std::allocator>::type>(keys, rounds);
+	unsigned long theap = container_benchmark<map_of<heap_allocator>::type>(keys, rounds);
+	unsigned long tpool = container_benchmark<map_of<pool_allocator>::type>(keys, rounds);
+	std::cout << "std::map           std::allocator " << tm << " us, memheap::allocator " << theap << " us, memheap::pool_allocator " << tpool << " us" << std::endl;
+	std::cout << "[std::allocator speed]/[pool_allocator speed]=" << tm/(float)tpool
+		<< " [allocator speed]/[pool_allocator speed]=" << theap/(float)tpool << std::endl;
+
+	tm = container_benchmark<hash_of<std::allocator>::type>(keys, rounds);
+	theap = container_benchmark<hash_of<heap_allocator>::type>(keys, rounds);
+	tpool = container_benchmark<hash_of<pool_allocator>::type>(keys, rounds);
+	std::cout << "std::unordered_map std::allocator " << tm << " us, memheap::allocator " << theap << " us, memheap::pool_allocator " << tpool << " us" << std::endl;
+	std::cout << "[std::allocator speed]/[pool_allocator speed]=" << tm/(float)tpool
+		<< " [allocator speed]/[pool_allocator speed]=" << theap/(float)tpool << std::endl;
+
+	free_std_allocator();
+}
+
+int main()
+{
+	std::cout << "Running std container benchmarks..." << std::endl;
+	std::srand(std::time(0));
+
+	run(1000, 1000, false);
+	std::cout << std::endl;
+	run(100000, 10, false);
+	std::cout << std::endl;
+	run(100000, 10, true);
+	std::cout << std::endl;
+
+	return 0;
+}